@@ -0,0 +1,60 @@
+"""Multi-threaded throughput benchmark for wrapped functions.
+
+Calls a wrapped function from an increasing number of threads and reports
+the total call throughput.  On a free-threaded (``python3.13t``) build the
+throughput should scale with the number of cores, since every thread updates
+its own counter shard.  With the GIL it will stay flat.
+"""
+# ruff: noqa: T201
+
+from __future__ import annotations
+
+import os
+import sys
+import threading
+import time
+
+from telemetric.statswrapper import stats_deco
+
+CALLS_PER_THREAD = 1_000_000
+
+
+@stats_deco(None, b=(True, False))  # type: ignore[no-untyped-call]
+def func(a, b=False):
+    return a, b
+
+
+def work(barrier: threading.Barrier) -> None:
+    barrier.wait()
+    for i in range(CALLS_PER_THREAD):
+        func(i, b=True)
+
+
+def run(nthreads: int) -> float:
+    barrier = threading.Barrier(nthreads + 1)
+    threads = [
+        threading.Thread(target=work, args=(barrier,)) for _ in range(nthreads)
+    ]
+    for t in threads:
+        t.start()
+    barrier.wait()
+    start = time.perf_counter()
+    for t in threads:
+        t.join()
+    return nthreads * CALLS_PER_THREAD / (time.perf_counter() - start)
+
+
+gil_enabled = getattr(sys, "_is_gil_enabled", lambda: True)()
+print(f"GIL enabled: {gil_enabled}, cpus: {os.cpu_count()}")
+
+expected = 0
+single = None
+for nthreads in range(1, (os.cpu_count() or 1) + 1):
+    rate = run(nthreads)
+    expected += nthreads * CALLS_PER_THREAD
+    single = single or rate
+    print(f"{nthreads:3d} threads: {rate / 1e6:8.2f} Mcalls/s ({rate / single:.2f}x)")
+
+# All updates must be accounted for, no matter how many threads were used.
+assert func._get_counts() == (expected, 0, 0)
+assert func._get_param_stats()[1][3] == (expected, 0)
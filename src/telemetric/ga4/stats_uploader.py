@@ -5,7 +5,7 @@ from __future__ import annotations
 from typing import Any
 
 from telemetric.ga4.analytics import AnalyticsClient
-from telemetric.statswrapper import _wrapped
+from telemetric.statswrapper import _func_name, snapshot_all
 
 
 class StatsUploader:
@@ -96,7 +96,7 @@ class StatsUploader:
 
         # Build event parameters
         event_params: dict[str, Any] = {
-            "function_name": f"{wrapped_func.__module__}.{wrapped_func.__name__}",
+            "function_name": _func_name(wrapped_func),
             "total_calls": total_calls,
             "error_calls": error_calls,
             "invalid_args": invalid_args,
@@ -108,6 +108,12 @@ class StatsUploader:
         if package_name:
             event_params["package_name"] = package_name
 
+        # Add latency quantiles if a quantile sketch is recorded
+        sketch = wrapped_func._get_sketch()  # pylint: disable=protected-access
+        if sketch is not None and sketch.count > 0:
+            for name, q in (("p50", 0.5), ("p90", 0.9), ("p99", 0.99)):
+                event_params[f"time_{name}"] = sketch.quantile(q)
+
         # Add parameter usage statistics
         param_data: dict[str, Any] = {}
         for name, n_uses, known_params, param_counts in param_stats:
@@ -164,12 +170,17 @@ class StatsUploader:
             >>> result = uploader.upload_all_stats(package_name="mylib")
             >>> print(f"{result['uploaded']}/{result['total_functions']} uploaded")
         """
+        # A single C call gathers the counters of all wrappers
+        snapshot = snapshot_all()
+        calls = snapshot.column("calls")
+        errors = snapshot.column("errors")
+
         if not self.analytics.enabled:
             return {
                 "uploaded": 0,
                 "failed": 0,
                 "skipped": 0,
-                "total_functions": len(_wrapped),
+                "total_functions": len(snapshot),
                 "status": "disabled",
             }
 
@@ -177,11 +188,8 @@ class StatsUploader:
         failed = 0
         skipped = 0
 
-        for wrapped_func in _wrapped:
-            counts = wrapped_func._get_counts()  # pylint: disable=protected-access
-            total_calls = counts[0]
-
-            if skip_uncalled and total_calls == 0:
+        for i, wrapped_func in enumerate(snapshot.wrappers):
+            if skip_uncalled and calls[i] == 0:
                 skipped += 1
                 continue
 
@@ -194,20 +202,10 @@ class StatsUploader:
 
         # Upload summary statistics
         summary_params: dict[str, Any] = {
-            "total_wrapped_functions": len(_wrapped),
-            "functions_called": sum(
-                1
-                for f in _wrapped
-                if f._get_counts()[0] > 0  # pylint: disable=protected-access
-            ),
-            "total_function_calls": sum(
-                f._get_counts()[0]  # pylint: disable=protected-access
-                for f in _wrapped
-            ),
-            "total_errors": sum(
-                f._get_counts()[1]  # pylint: disable=protected-access
-                for f in _wrapped
-            ),
+            "total_wrapped_functions": len(snapshot),
+            "functions_called": sum(1 for n in calls if n > 0),
+            "total_function_calls": sum(calls),
+            "total_errors": sum(errors),
         }
 
         if package_name:
@@ -226,7 +224,7 @@ class StatsUploader:
             "uploaded": uploaded,
             "failed": failed,
             "skipped": skipped,
-            "total_functions": len(_wrapped),
+            "total_functions": len(snapshot),
             "status": status,
         }
 
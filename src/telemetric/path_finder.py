@@ -6,7 +6,7 @@ from importlib.abc import MetaPathFinder
 from importlib.machinery import SourceFileLoader
 from importlib.util import spec_from_loader
 
-from telemetric.statswrapper import stats_deco_auto
+from telemetric.statswrapper import monitor, stats_deco_auto
 
 __all__ = ["install"]
 
@@ -14,14 +14,18 @@ __all__ = ["install"]
 class TelemetryMetaFinder(MetaPathFinder):
     """MetaPathFinder implementation that overrides spec loaders with telemetry-enabled loaders."""
 
-    def __init__(self, module_names: list[str], *args, **kwargs) -> None:  # type: ignore[no-untyped-def]
+    def __init__(  # type: ignore[no-untyped-def]
+        self, module_names: list[str], *args, use_monitoring: bool = False, **kwargs
+    ) -> None:
         """MetaPathFinder implementation that overrides a spec loader
         of type SourceFileLoader with a TelemetrySpanLoader.
 
         Args:
             module_names (List[str]): Module names to include.
+            use_monitoring (bool): Use `sys.monitoring` instead of wrapping.
         """
         self._module_names = module_names
+        self._use_monitoring = use_monitoring
         super().__init__(*args, **kwargs)
 
     def find_spec(self, fullname: str, path, target=None):  # type: ignore[no-untyped-def]
@@ -34,7 +38,9 @@ class TelemetryMetaFinder(MetaPathFinder):
                             return spec_from_loader(
                                 name=spec.name,
                                 loader=TelemetrySpanSourceFileLoader(
-                                    spec.name, spec.origin or ""
+                                    spec.name,
+                                    spec.origin or "",
+                                    use_monitoring=self._use_monitoring,
                                 ),
                                 origin=spec.origin,
                             )
@@ -46,8 +52,15 @@ class TelemetryMetaFinder(MetaPathFinder):
 class TelemetrySpanSourceFileLoader(SourceFileLoader):
     """SourceFileLoader that automatically adds telemetry decorators to functions and methods."""
 
+    def __init__(self, fullname: str, path: str, *, use_monitoring: bool = False):
+        super().__init__(fullname, path)
+        self._use_monitoring = use_monitoring
+
     def exec_module(self, module) -> None:  # type: ignore[no-untyped-def]
         super().exec_module(module)
+        if self._use_monitoring:
+            self._monitor_module(module)
+            return
         functions = inspect.getmembers(module, predicate=inspect.isfunction)
         classes = inspect.getmembers(module, predicate=inspect.isclass)
 
@@ -66,6 +79,40 @@ class TelemetrySpanSourceFileLoader(SourceFileLoader):
                     setattr(_class, name, stats_deco_auto(method))
 
 
-def install(module_names: list[str]) -> None:
-    """Inserts the finder into the import machinery"""
-    sys.meta_path.insert(0, TelemetryMetaFinder(module_names))
+    @staticmethod
+    def _monitor_module(module) -> None:  # type: ignore[no-untyped-def]
+        # Functions stay in place, generators and coroutines are skipped.
+        seen = set()
+        for _, obj in inspect.getmembers(module):
+            if inspect.isclass(obj) and inspect.getmodule(obj) == module:
+                methods = [
+                    m
+                    for name, m in inspect.getmembers(obj, predicate=inspect.isfunction)
+                    if not name.startswith("_")
+                ]
+            elif inspect.isfunction(obj) and inspect.getmodule(obj) == module:
+                methods = [obj]
+            else:
+                continue
+            for method in methods:
+                if method.__code__ in seen:
+                    continue
+                seen.add(method.__code__)
+                if not (
+                    inspect.isgeneratorfunction(method)
+                    or inspect.iscoroutinefunction(method)
+                    or inspect.isasyncgenfunction(method)
+                ):
+                    monitor(method)
+
+
+def install(module_names: list[str], *, use_monitoring: bool = False) -> None:
+    """Inserts the finder into the import machinery
+
+    If ``use_monitoring`` is set (Python 3.12+), functions are not replaced
+    but their calls are recorded via `sys.monitoring` (see
+    `telemetric.statswrapper.monitor`).
+    """
+    sys.meta_path.insert(
+        0, TelemetryMetaFinder(module_names, use_monitoring=use_monitoring)
+    )
@@ -2,17 +2,53 @@
 # pylint: disable=import-error,no-name-in-module
 from __future__ import annotations
 
-import functools
 import inspect
 import sys
+import weakref
 
 from ._stats_wrapper import (  # type: ignore[import-not-found]
+    QuantileSketch,
+    StatsSnapshot,
     _StatsWrapper,
+    collected_stats,
+    disable,
+    enable,
+    is_enabled,
+    snapshot_all,
+    snapshot_and_reset_all,
     stats_wrapper,
 )
+from .arena import ArenaReader, export_counters
+from .callgraph import call_graph, write_collapsed
+
+
+def _func_name(func: _StatsWrapper) -> str:
+    # Wrappers not created via the decorators may lack the name attributes.
+    name = getattr(func, "__name__", None)
+    if name is None:
+        return repr(func)
+    return f"{func.__module__}.{name}"
+
+
+def _update_wrapper(new: _StatsWrapper, func) -> None:  # type: ignore[no-untyped-def]
+    # Like `functools.update_wrapper`, but ``__name__``, ``__doc__``,
+    # ``__wrapped__``, etc. are looked up on ``func`` by the wrapper itself.
+    # So the wrapper only gets a ``__dict__`` if ``func`` has attributes.
+    attributes = getattr(func, "__dict__", None)
+    if attributes:
+        new.__dict__.update(
+            (key, value) for key, value in attributes.items() if key != "__wrapped__"
+        )
+
 
-# Keep a list of all wrapped functions (could be per package or so...)
-_wrapped: list[_StatsWrapper] = []
+def _format_times(times: dict[str, float], digits: int | None) -> dict[str, str]:
+    # The histograms (e.g. ``cpu_histogram``) are left out.
+    fmt = "e" if digits is None else f".{digits}e"
+    return {
+        key: format(value, fmt)
+        for key, value in times.items()
+        if isinstance(value, (int, float))
+    }
 
 
 def print_all_stats(skip_uncalled: bool = True, timing_digits: int | None = 6) -> None:  # noqa: ARG001  # pylint: disable=unused-argument
@@ -29,12 +65,16 @@ def print_all_stats(skip_uncalled: bool = True, timing_digits: int | None = 6) -
     print()  # noqa: T201
     print("Statistics for argument usage of wrapped functions")  # noqa: T201
     print("--------------------------------------------------")  # noqa: T201
-    sorted_w = sorted(_wrapped, key=lambda x: x._get_counts()[0], reverse=True)  # pylint: disable=protected-access
-    for func in sorted_w:
-        counts = func._get_counts()  # pylint: disable=protected-access
-        if counts[0] == 0:
+    snapshot = snapshot_all()
+    calls = snapshot.column("calls")
+    errors = snapshot.column("errors")
+    invalid = snapshot.column("invalid")
+    order = sorted(range(len(snapshot)), key=calls.__getitem__, reverse=True)
+    for i in order:
+        if calls[i] == 0:
             continue
-        counts = f"{counts[0]},{counts[1]},{counts[2]}"
+        func = snapshot.wrappers[i]
+        counts = f"{calls[i]},{errors[i]},{invalid[i]}"
         stats = func._get_param_stats()  # pylint: disable=protected-access
         argcounts = []
         for name, n_uses, _, _ in stats:
@@ -45,16 +85,25 @@ def print_all_stats(skip_uncalled: bool = True, timing_digits: int | None = 6) -
 
         argcounts_str = ", ".join(argcounts)
         timing = func._get_timing()  # pylint: disable=protected-access
-        if timing_digits is not None:
-            timing_formatted = {k: f"{v:.{timing_digits}e}" for k, v in timing.items()}
-        else:
-            timing_formatted = {k: f"{v:e}" for k, v in timing.items()}
-        timing_str = f" timing={timing_formatted}"
-        summary_str = (
-            f"{func.__module__}.{func.__name__}[{counts}]({argcounts_str}){timing_str}"
-        )
+        timing_str = f" timing={_format_times(timing, timing_digits)}"
+        summary_str = f"{_func_name(func)}[{counts}]({argcounts_str}){timing_str}"
         print(summary_str)  # noqa: T201
 
+    collected = collected_stats()
+    if collected:
+        print()  # noqa: T201
+        print("Deallocated wrappers by module")  # noqa: T201
+        print("------------------------------")  # noqa: T201
+        for module, totals in sorted(
+            collected.items(), key=lambda item: item[1]["calls"], reverse=True
+        ):
+            counts = f"{totals['calls']},{totals['errors']},{totals['invalid']}"
+            total = _format_times(
+                {"total": totals["est_total_ns"] * 1e-9}, timing_digits
+            )["total"]
+            wrappers = totals["wrappers"]
+            print(f"{module}[{counts}] wrappers={wrappers} total={total}")  # noqa: T201
+
 
 def stats_deco(*args, **kwargs):  # type: ignore[no-untyped-def]
     """
@@ -81,8 +130,9 @@ def stats_deco(*args, **kwargs):  # type: ignore[no-untyped-def]
         @stats_deco(None, ("a", "b"), pos1=None, pos2=("a", "b"))
 
     This tracker is meant for a non-large amount of keyword arguments in which
-    case it is extremely light-weight.  For a large of keyword arguments
-    the performance may deteriorate.
+    case it is extremely light-weight.  The keyword names used at a call site
+    are resolved once and cached (for the first few call sites), so that
+    wide signatures are cheap as well.
 
     Parameters
     ----------
@@ -105,30 +155,120 @@ def stats_deco(*args, **kwargs):  # type: ignore[no-untyped-def]
         * The parameters we are keeping track of explicitly (or None)
         * The number of times the corresponding parameter was used (or None)
 
+    _enable_type_stats : () -> None
+        Also count the types of the objects passed for each argument.  Must be
+        called before the first call.
+
+    _get_type_stats : tuple of tuples
+        Returns a tuple with one entry for each argument containing:
+        * The keyword argument name or None (positional only).
+        * A dict mapping the types passed to how often they were passed, or
+          None if type stats are not enabled.
+        * How often other types were passed (only the first 8 distinct types
+          are counted individually).
+
+    _enable_array_stats : (*params) -> None
+        Profile the size, ndim and dtype of array-like arguments (buffer
+        protocol, ``__array_interface__`` or ``len()``).  ``params`` are
+        argument indices or keyword names, all arguments if none are given.
+        Must be called before the first call.
+
+    _get_array_stats : tuple of tuples
+        Returns a tuple with one entry for each argument containing:
+        * The keyword argument name or None (positional only).
+        * None if array stats are not enabled, otherwise a dict with
+          'sizes' (counts keyed by the smallest size of each power of two
+          bucket), 'size_timing' (average time in seconds per size bucket
+          of the first profiled argument), 'ndim', 'dtypes' (the first 8
+          distinct ones), 'other_dtypes' and 'unsized' (no size found).
+
     _get_timing : dict
         Returns timing statistics as a dictionary with the following keys:
         * 'total': Total time spent in all calls (seconds)
+        * 'self': Time excluding nested calls to wrapped functions (seconds)
+        * 'outermost': Total time of the non-recursive calls (seconds)
+        * 'wall': Like 'total', but for generators, coroutines and async
+          generators from their first resumption until they finish (while
+          the others only include the time they were running)
         * 'average': Average time per call (seconds)
         * 'min': Minimum time for a single call (seconds)
         * 'max': Maximum time for a single call (seconds)
-
-        Timing uses `time.perf_counter()` with nanosecond resolution on most
-        platforms. Times are stored as 64-bit floats (C double) providing
-        approximately 15-17 significant digits of precision.
+        * 'samples': Number of calls that were actually timed
+
+        When sampling is enabled, only a subset of calls is timed, 'total',
+        'self' and 'outermost' are then estimates scaled up to all calls and
+        the others are computed from the timed calls only.
+
+        Timing reads the `time.perf_counter()` clock natively with nanosecond
+        resolution on most platforms. Times are accumulated as 64-bit integer
+        nanoseconds, so the total stays exact even over billions of calls.
+
+    _enable_cpu_time : () -> None
+        Also measure the CPU time of the current thread for timed calls
+        (must be enabled before the first call).  `_get_timing` then
+        contains 'cpu_total' and 'cpu_average' (seconds) and
+        'cpu_histogram' (like `_get_histogram`).  Compared to the wall
+        time, this shows how much time was spent waiting (e.g. for I/O or
+        locks) rather than computing.
+
+    _get_histogram : dict
+        Returns a latency histogram of the timed calls with log-linear
+        buckets (each power of two is split into eight buckets):
+        * 'p50', 'p90', 'p99', 'p999': Estimated quantiles (seconds), the
+          middle of the bucket so within 6.25% of the true value
+        * 'buckets': The number of calls in each bucket
+        * 'lower_bounds': The smallest duration of each bucket (seconds)
+
+    _get_callers : list of tuples
+        Returns ``(caller, calls, time, self_time)`` for each wrapped
+        function that called this one (times are estimates in seconds).
+        Only the first 8 distinct callers are tracked individually, calls
+        from others (or from deallocated wrappers) are listed with caller
+        None.  `call_graph()` collects these for all wrappers.
+
+    _enable_sketch : (relative_accuracy=0.01, max_bins=2048) -> None
+        Additionally record all timed calls in a `QuantileSketch`.  Unlike
+        the histogram, its quantiles have a guaranteed relative error and
+        sketches can be serialized and merged across processes and hosts.
+
+    _get_sketch : QuantileSketch or None
+        Returns a copy of the quantile sketch (durations in seconds) or
+        None if it was not enabled.
+
+    _snapshot_and_reset : dict
+        Returns all stats and resets them in one step (no call is lost or
+        counted twice), for exporters that ship deltas.  The dict contains
+        the results of the getters above as 'counts', 'timing',
+        'histogram', 'param_stats', 'type_stats', 'array_stats' and
+        'callers', and the recorded 'sketch' (or None).  `snapshot_and_reset_all()` does this
+        for all wrappers that were called since the last reset.
+
+    _set_sampling : (interval=1, max_rate=0) -> None
+        Only time every ``interval`` call (``0`` disables timing).  Call and
+        argument counts are always exact.  If ``max_rate`` is given, the
+        interval adapts so that at most ``max_rate`` calls per second are
+        timed.
     """
 
     def deco(func):  # type: ignore[no-untyped-def]
         new_func = stats_wrapper(func, *args, **kwargs)
-        functools.update_wrapper(new_func, func)
-        _wrapped.append(new_func)
-        if hasattr(func, "__code__"):
-            new_func.__code__ = func.__code__
+        _update_wrapper(new_func, func)
         return new_func
 
     return deco
 
 
-def stats_deco_auto(func, /, *, track_positional_use: bool = False):  # type: ignore[no-untyped-def]
+def stats_deco_auto(  # type: ignore[no-untyped-def]
+    func,
+    /,
+    *,
+    track_positional_use: bool = False,
+    sample_interval: int = 1,
+    max_sample_rate: int = 0,
+    track_types: bool = True,
+    track_arrays: bool = False,
+    track_cpu_time: bool = False,
+):
     """Similar to `stats_deco`, but attempts to use inspect to add
     any arguments and keyword arguments automatically.
 
@@ -140,6 +280,20 @@ def stats_deco_auto(func, /, *, track_positional_use: bool = False):  # type: ig
         If set to ``True`` arguments that are both positional or keyword
         are also tracked as positional only.  That way it is possible to
         find out how if users used the param positionally or by keyword.
+    sample_interval : int
+        Only time every ``sample_interval`` call, ``0`` disables timing.
+    max_sample_rate : int
+        If non-zero, adapt the sampling interval so that at most this many
+        calls are timed per second.
+    track_types : bool
+        If set (the default), also count the types passed for each argument
+        (see `_get_type_stats`).
+    track_arrays : bool
+        If set, also profile the size, ndim and dtype of array-like
+        arguments (see `_get_array_stats`).
+    track_cpu_time : bool
+        If set, also measure the thread CPU time of the timed calls (see
+        `_enable_cpu_time`).
     """
     if isinstance(func, _StatsWrapper):
         # Already wrapped, assume the same options were used.
@@ -178,15 +332,158 @@ def stats_deco_auto(func, /, *, track_positional_use: bool = False):  # type: ig
 
     new = stats_wrapper(func, *args, **kwargs)
     new._set_npos(len(args) + positional_kws)  # pylint: disable=protected-access
+    if track_types:
+        new._enable_type_stats()  # pylint: disable=protected-access
+    if track_arrays:
+        new._enable_array_stats()  # pylint: disable=protected-access
+    if track_cpu_time:
+        new._enable_cpu_time()  # pylint: disable=protected-access
+    if sample_interval != 1 or max_sample_rate:
+        new._set_sampling(sample_interval, max_sample_rate)  # pylint: disable=protected-access
+
+    _update_wrapper(new, func)
+    return new
 
-    functools.update_wrapper(new, func)
-    if hasattr(func, "__code__"):
-        new.__code__ = func.__code__
 
-    _wrapped.append(new)
+_CO_NOT_MONITORABLE = (
+    inspect.CO_GENERATOR | inspect.CO_COROUTINE | inspect.CO_ASYNC_GENERATOR
+)
+# Ids 0-2 and 5 are reserved for debuggers, coverage, profilers (cProfile
+# uses PROFILER_ID) and optimizers.
+_MONITORING_TOOL_IDS = (3, 4)
+_MONITOR_ATTRIBUTE = "_telemetric_monitor"
+_monitoring_tool: int | None = None
+_monitored_funcs: weakref.WeakSet = weakref.WeakSet()  # type: ignore[type-arg]
+
+
+def _start_monitoring() -> None:
+    # pylint: disable=import-outside-toplevel
+    from ._stats_wrapper import (  # type: ignore[import-not-found]
+        _monitor_py_return,
+        _monitor_py_start,
+        _monitor_py_unwind,
+    )
+
+    global _monitoring_tool  # noqa: PLW0603  # pylint: disable=global-statement
+    monitoring = sys.monitoring  # type: ignore[attr-defined]
+    events = monitoring.events
+    for tool in _MONITORING_TOOL_IDS:
+        if monitoring.get_tool(tool) is None:
+            break
+    else:
+        msg = "No free sys.monitoring tool id."
+        raise RuntimeError(msg)
+    monitoring.use_tool_id(tool, "telemetric")
+    monitoring.register_callback(tool, events.PY_START, _monitor_py_start)
+    monitoring.register_callback(tool, events.PY_RETURN, _monitor_py_return)
+    monitoring.register_callback(tool, events.PY_UNWIND, _monitor_py_unwind)
+    # PY_UNWIND cannot be a local event, it only fires for exceptions though.
+    monitoring.set_events(tool, events.PY_UNWIND)
+    _monitoring_tool = tool
+
+
+def _set_code_events(code, enable: bool) -> None:  # type: ignore[no-untyped-def]
+    # Events are only enabled for the monitored code, so that other code
+    # is not instrumented at all.
+    monitoring = sys.monitoring  # type: ignore[attr-defined]
+    events = monitoring.events
+    # Clearing them first re-enables locations a callback disabled.
+    monitoring.set_local_events(_monitoring_tool, code, 0)
+    if enable:
+        monitoring.set_local_events(
+            _monitoring_tool, code, events.PY_START | events.PY_RETURN
+        )
+
+
+def _stop_monitoring() -> None:
+    global _monitoring_tool  # noqa: PLW0603  # pylint: disable=global-statement
+    monitoring = sys.monitoring  # type: ignore[attr-defined]
+    events = monitoring.events
+    tool = _monitoring_tool
+    monitoring.set_events(tool, 0)
+    # Code of functions that were freed while monitored may still have events
+    clear_tool_id = getattr(monitoring, "clear_tool_id", None)  # 3.14+
+    if clear_tool_id is not None:
+        clear_tool_id(tool)
+    for event in (events.PY_START, events.PY_RETURN, events.PY_UNWIND):
+        monitoring.register_callback(tool, event, None)
+    monitoring.free_tool_id(tool)
+    _monitoring_tool = None
+
+
+def monitor(func, /):  # type: ignore[no-untyped-def]
+    """Gather call counts and timings for ``func`` via ``sys.monitoring``.
+
+    Unlike `stats_deco_auto`, ``func`` is not replaced: calls through any
+    reference to it are counted and identity checks keep working.  Only
+    counts and timings are available (no argument stats).  Requires
+    Python 3.12 or later and uses a free ``sys.monitoring`` tool id (not the
+    one of profilers such as cProfile).  The function keeps the wrapper
+    alive until it is freed or `unmonitor` is called.
+
+    Returns
+    -------
+    wrapper : _StatsWrapper
+        A wrapper whose stats methods (``_get_counts``, ``_get_timing``,
+        ...) report the calls of ``func``.  Calling it calls ``func``.
+    """
+    try:
+        # pylint: disable=import-outside-toplevel
+        from ._stats_wrapper import (  # type: ignore[import-not-found]
+            _monitor_register,
+            _monitor_unregister,
+        )
+    except ImportError:
+        msg = "monitor() requires sys.monitoring (Python 3.12+)."
+        raise RuntimeError(msg) from None
+
+    code = getattr(func, "__code__", None)
+    if code is None or code.co_flags & _CO_NOT_MONITORABLE:
+        msg = f"Cannot monitor {func!r}, must be a plain Python function."
+        raise TypeError(msg)
+
+    func.__dict__.pop(_MONITOR_ATTRIBUTE, None)
+    new = stats_wrapper(func)
+    _update_wrapper(new, func)
+    _monitor_register(code, new)
+    try:
+        if _monitoring_tool is None:
+            _start_monitoring()
+        _set_code_events(code, True)
+    except BaseException:
+        _monitor_unregister(new)
+        raise
+    # The code only borrows the wrapper, the cycle through the function is
+    # visible to the GC.
+    setattr(func, _MONITOR_ATTRIBUTE, new)
+    _monitored_funcs.add(func)
+
     return new
 
 
+def unmonitor(func, /) -> None:  # type: ignore[no-untyped-def]
+    """Stop gathering stats for ``func`` started by `monitor`.
+
+    The ``sys.monitoring`` tool id is freed when no function is monitored
+    anymore.
+    """
+    # pylint: disable=import-outside-toplevel
+    from ._stats_wrapper import (  # type: ignore[import-not-found]
+        _monitor_unregister,
+    )
+
+    wrapper = getattr(func, "__dict__", {}).pop(_MONITOR_ATTRIBUTE, None)
+    if wrapper is None:
+        msg = f"{func!r} is not monitored."
+        raise ValueError(msg)
+    code = _monitor_unregister(wrapper)
+    if code is not None:  # not replaced by monitoring another function with it
+        _set_code_events(code, False)
+    _monitored_funcs.discard(func)
+    if not _monitored_funcs and _monitoring_tool is not None:
+        _stop_monitoring()
+
+
 def install_in_module_by_name(
     name: str, /, *, track_positional_use: bool = False
 ) -> None:
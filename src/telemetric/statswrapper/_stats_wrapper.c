@@ -3,427 +3,6058 @@
 #include <Python.h>
 #include "structmember.h"
 
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
 
+#if PY_VERSION_HEX >= 0x030D0000 && !defined(PYPY_VERSION)
+#define HAVE_PYTIME_PERFCOUNTER 1
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if SIZEOF_VOID_P == 8 && defined(__AVX2__)
+#include <immintrin.h>
+#define POINTER_SCAN_AVX2 1
+#elif SIZEOF_VOID_P == 8 && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define POINTER_SCAN_SSE2 1
+#elif SIZEOF_VOID_P == 8 && defined(__aarch64__)
+#include <arm_neon.h>
+#define POINTER_SCAN_NEON 1
+#endif
+
+#if PY_VERSION_HEX >= 0x030C0000 && !defined(PYPY_VERSION)
+#define HAVE_MONITORING 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+#define CACHE_LINE 64
+
+/*
+ * Latency histogram with log-linear buckets (as in HdrHistogram): every power
+ * of two is split into HIST_SUB_COUNT linear sub-buckets, so the bucket width
+ * is at most 1/HIST_SUB_COUNT of its value.  Durations of 2**HIST_MAX_LOG2 ns
+ * (about 18 minutes) or longer all end up in the last bucket.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_LOG2 40
+#define HIST_BUCKETS ((HIST_MAX_LOG2 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+
+/*
+ * On free-threaded builds, counters are updated with relaxed atomics.  Since
+ * every thread writes into its own shard (see below), these are practically
+ * always uncontended.  With the GIL they are plain loads and stores.
+ */
+#ifdef Py_GIL_DISABLED
+#define COUNTER_SHARDS 16
+#define COUNTER_ADD(field, value) _Py_atomic_add_ssize(&(field), (value))
+#define COUNTER_ADD64(field, value) _Py_atomic_add_int64(&(field), (value))
+#define COUNTER_LOAD(field) _Py_atomic_load_ssize_relaxed(&(field))
+#define COUNTER_LOAD64(field) _Py_atomic_load_int64_relaxed(&(field))
+#define COUNTER_STORE(field, value) _Py_atomic_store_ssize_relaxed(&(field), (value))
+#define COUNTER_STORE64(field, value) _Py_atomic_store_int64_relaxed(&(field), (value))
+#else
+#define COUNTER_SHARDS 1
+#define COUNTER_ADD(field, value) ((field) += (value))
+#define COUNTER_ADD64(field, value) ((field) += (value))
+#define COUNTER_LOAD(field) (field)
+#define COUNTER_LOAD64(field) (field)
+#define COUNTER_STORE(field, value) ((field) = (value))
+#define COUNTER_STORE64(field, value) ((field) = (value))
+#endif
+
+
+/*
+ * Calls are counted by their (wrapped) caller in a small open addressing
+ * table of caller ids (see `wrapper_id`).  Once CALLER_TABLE_MAX callers were
+ * seen, further ones are counted as "other" in the last counter.
+ */
+#define CALLER_TABLE_SIZE 16
+#define CALLER_TABLE_MAX 8
+
+
+/*
+ * All counters that are updated by a call live in a counter block.  There is
+ * one block per shard and each block is padded to a full cache line, so that
+ * threads using different shards never share a cache line.  The argument
+ * counts are stored in `slots`, the `arginfo` stores the slot indices.
+ * The sampling state is also per shard, so that it is only written to by the
+ * threads using that shard.
+ */
+typedef struct {
+    Py_ssize_t total_calls;
+    Py_ssize_t invalid_args;
+    Py_ssize_t error_results;
+    /* Timings are in nanoseconds, int64 keeps the total exact. */
+    Py_ssize_t timed_calls;
+    int64_t total_time;
+    int64_t min_time;
+    int64_t max_time;
+    /*
+     * Sampling: only every `sample_interval` call is timed (0 disables
+     * timing).  `est_total_time` weights each sample by the interval it
+     * was taken at, so it estimates the total over all calls.
+     */
+    int64_t est_total_time;
+    /*
+     * Estimated (like `est_total_time`) exclusive time, i.e. without the
+     * time spent in nested wrapped calls, and the time of the outermost
+     * calls only (recursive calls are not counted again).
+     */
+    int64_t est_self_time;
+    int64_t est_outer_time;
+    /* For generators, etc. the time from first resumption to finish */
+    int64_t est_wall_time;
+    Py_ssize_t sample_interval;
+    Py_ssize_t sample_countdown;
+    Py_ssize_t window_samples;
+    int64_t window_start;
+    int64_t slots[];
+} statscounters;
+
+
+/*
+ * The latency histogram of the timed calls, one per shard (padded like the
+ * counter blocks).  At HIST_BUCKETS counts it is much larger than all other
+ * counters, so it is only allocated on the first timed call (see
+ * `get_histogram()`).
+ */
+#define HIST_STRIDE \
+    ((HIST_BUCKETS * sizeof(Py_ssize_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+
+/*
+ * Calls, estimated time and self time by caller (indexed like the wrapper's
+ * `callers`), calls without a wrapped caller are not included.  Most
+ * wrappers are only called from unwrapped code, so these blocks (one per
+ * shard, padded like the counter blocks) are only allocated once the first
+ * wrapped caller is seen.
+ */
+typedef struct {
+    int64_t calls[CALLER_TABLE_SIZE + 1];
+    int64_t time[CALLER_TABLE_SIZE + 1];
+    int64_t self_time[CALLER_TABLE_SIZE + 1];
+} callercounters;
+
+#define CALLER_COUNTERS_STRIDE \
+    ((sizeof(callercounters) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+
+/*
+ * The types passed for an argument can be counted in a small open addressing
+ * table keyed by the type pointer.  Once TYPE_TABLE_MAX types were seen, all
+ * further ones are counted as "other".
+ */
+#define TYPE_TABLE_SIZE 16
+#define TYPE_TABLE_MAX 8
+
+
+/*
+ * Optional profile of array-like arguments: a log2 histogram of their size
+ * (number of elements, or `len()`), their ndim and their dtype (the buffer
+ * format or `__array_interface__["typestr"]`).  The layout of the slots is:
+ * ARRAY_SIZE_BUCKETS size counts, the number of timed calls and their total
+ * time (by size of the first profiled argument), ARRAY_NDIM_SLOTS ndim counts
+ * (the last for larger ndim), DTYPE_TABLE_MAX + 1 dtype counts (the last one
+ * for "other") and finally a count for arguments without any size.
+ */
+#define ARRAY_SIZE_BUCKETS 48
+#define ARRAY_NDIM_SLOTS 9
+#define DTYPE_TABLE_MAX 8
+#define ARRAY_TIMED_OFFSET ARRAY_SIZE_BUCKETS
+#define ARRAY_TIME_OFFSET (2 * ARRAY_SIZE_BUCKETS)
+#define ARRAY_NDIM_OFFSET (3 * ARRAY_SIZE_BUCKETS)
+#define ARRAY_DTYPE_OFFSET (ARRAY_NDIM_OFFSET + ARRAY_NDIM_SLOTS)
+#define ARRAY_UNSIZED_OFFSET (ARRAY_DTYPE_OFFSET + DTYPE_TABLE_MAX + 1)
+#define ARRAY_SLOTS (ARRAY_UNSIZED_OFFSET + 1)
+
+
+/*
+ * Optional thread CPU time of the timed calls: a histogram like the one of
+ * the (wall) time, the number of measured calls, their total CPU time and
+ * the total estimated over all calls (like `est_total_time`).
+ */
+#define CPU_TIMED_OFFSET HIST_BUCKETS
+#define CPU_TIME_OFFSET (HIST_BUCKETS + 1)
+#define CPU_EST_TIME_OFFSET (HIST_BUCKETS + 2)
+#define CPU_SLOTS (HIST_BUCKETS + 3)
+
+
+/* Hash table entry mapping a hash to its index in `known_params`. */
+typedef struct {
+    Py_hash_t hash;
+    Py_ssize_t index;  // -1 for empty entries
+} param_entry;
+
+
+/*
+ * What is fixed by the signature a wrapper was created with, for each
+ * argument.  Shared by all wrappers with the same signature (see
+ * `SignatureSpecObject`), so it is never modified after creation.
+ */
+typedef struct {
+    PyObject *kwname;  // NULL for positional only arguments
+    PyObject *known_params;
+    /*
+     * Open addressing hash table for the hashable `known_params` (NULL if
+     * there are none).  Values that are not of a builtin type (see
+     * `has_builtin_hash()`) or are unhashable are listed in `unhashed`.
+     */
+    param_entry *param_table;
+    size_t param_mask;
+    Py_ssize_t *unhashed;  // indices of the `known_params` not in the table
+    Py_ssize_t n_unhashed;
+} argspec;
+
+
+/* The state of each argument of a wrapper, the rest is in the `argspec`. */
 typedef struct {
-    PyObject *kwname;
+    /* Borrowed from the `argspec`, to not look them up there on every call */
     PyObject *known_params;
-    Py_ssize_t count;
-    Py_ssize_t *param_counts;
+    param_entry *param_table;
+    size_t param_mask;
+    Py_ssize_t count_slot;
+    Py_ssize_t param_slots;  // first slot of the known_params counts
+    Py_ssize_t last_hit;  // index of the last tracked value that was passed
+    /*
+     * If type stats are enabled, the table of types passed (strong references)
+     * counted in TYPE_TABLE_SIZE + 1 slots from `type_slots` (the last one
+     * for "other" types).
+     */
+    PyTypeObject **types;
+    Py_ssize_t n_types;
+    Py_ssize_t type_slots;
+    /* If array stats are enabled, the dtypes seen (as str) and the slots */
+    PyObject **dtypes;
+    Py_ssize_t array_slots;
 } arginfo;
 
 
+/*
+ * The argument specs of a signature: the number of positional only
+ * arguments, the keyword names and the tracked values.  Interned in
+ * `signature_specs`, so that e.g. all methods wrapped by `stats_deco_auto`
+ * with the same parameters share one.
+ */
+typedef struct {
+    PyObject_VAR_HEAD
+    PyObject *key;  // in `signature_specs` or NULL if not interned
+    Py_ssize_t users;  // wrappers using an interned spec (under its lock)
+    Py_ssize_t npos_only;
+    argspec args[];  // NULL terminated by `kwname` (one more than arguments)
+} SignatureSpecObject;
+
+
+/*
+ * Relative-error quantile sketch (DDSketch).  A value `x` is counted in bin
+ * `ceil(log(x) / log(gamma))`, so every quantile is returned with a relative
+ * error of at most `(gamma - 1) / (gamma + 1)`.  Sketches with the same gamma
+ * can be merged exactly.  The bins are stored densely from `min_key`, if the
+ * range would exceed `max_bins` the lowest bins are collapsed (so only the
+ * lowest quantiles lose accuracy).
+ */
+typedef struct {
+    PyObject_HEAD
+    double gamma;
+    double log_gamma;
+    double min_indexable;
+    Py_ssize_t max_bins;
+    uint64_t count;
+    uint64_t zero_count;
+    double min;
+    double max;
+    int32_t min_key;
+    Py_ssize_t nbins;
+    uint64_t *bins;
+#ifdef Py_GIL_DISABLED
+    PyMutex mutex;
+#endif
+} QuantileSketchObject;
+
+#ifdef Py_GIL_DISABLED
+#define SKETCH_LOCK(sketch) PyMutex_Lock(&(sketch)->mutex)
+#define SKETCH_UNLOCK(sketch) PyMutex_Unlock(&(sketch)->mutex)
+#else
+#define SKETCH_LOCK(sketch)
+#define SKETCH_UNLOCK(sketch)
+#endif
+
+
+/*
+ * The resolved argument (index into `args`) for each name of a kwnames
+ * tuple, -1 if the keyword is not tracked.
+ */
+typedef struct {
+    PyObject *kwnames;
+    Py_ssize_t indices[];
+} kwnames_resolution;
+
+/*
+ * CPython reuses the same kwnames tuple for each call site, so we cache the
+ * resolution for the first few of them.  Entries are never replaced, so that
+ * they can be used without locking and stay valid even if the call recurses
+ * (comparing tracked values may call back into Python).
+ */
+#define KWNAMES_CACHE_SIZE 8
+
+
+typedef struct StatsWrapperObject {
+    PyObject_VAR_HEAD
+    vectorcallfunc vectorcall;
+    PyObject *wrapped;
+    /*
+     * The vectorcall of `wrapped` if it is a function, saves looking it up
+     * on every call.  (CPython itself never changes it for functions.)
+     */
+    vectorcallfunc wrapped_vectorcall;
+    PyObject *dict;
+    char *counters;  // COUNTER_SHARDS blocks of `counters_stride` bytes
+    Py_ssize_t counters_stride;
+    void *counters_alloc;  // unaligned allocation of `counters`
+    /*
+     * If set, the sampling interval adapts to stay below this many timed
+     * calls per second (and shard).
+     */
+    Py_ssize_t max_sample_rate;
+    QuantileSketchObject *sketch;  // optional, records all timed calls
+    kwnames_resolution *kwnames_cache[KWNAMES_CACHE_SIZE];
+    Py_ssize_t npos;
+    Py_ssize_t npos_only;
+    Py_ssize_t arena_entry;  // index in the shared counter arena or -1
+    Py_ssize_t reset_calls;  // calls dropped by `_snapshot_and_reset()`
+    /*
+     * Unique id (never reused, unlike the address) so that callers can be
+     * recorded without keeping them alive.  0 for no caller.
+     */
+    uint64_t wrapper_id;
+    uint64_t callers[CALLER_TABLE_SIZE];
+    Py_ssize_t n_callers;
+    void *caller_counters_alloc;  // unaligned, see `get_caller_counters()`
+    char *histograms;  // see `get_histogram()`
+    void *histograms_alloc;  // unaligned, NULL if `histograms` is in the arena
+    char *name;  // see `wrapper_name()`
+    /* Set if fed by sys.monitoring, calling it then only forwards. */
+    PyObject *monitored_code;
+    int gen_kind;  // GEN_GENERATOR, etc. if calls return a proxied object
+    Py_ssize_t cpu_slots;  // first of the CPU_SLOTS or -1 if not enabled
+    /* Intrusive list of all live wrappers (see `registry_head`) */
+    struct StatsWrapperObject *registry_prev;
+    struct StatsWrapperObject *registry_next;
+    /* Where the counts go on dealloc (see `module_totals_fold()`) */
+    struct module_totals *module_totals;
+    SignatureSpecObject *spec;
+    arginfo args[];  // one more than the number of arguments
+} StatsWrapperObject;
+
+
+/*
+ * Registry of all live wrappers, a doubly linked list of borrowed references
+ * (wrappers remove themselves on dealloc).  It allows switching all of them
+ * at once, e.g. to disable stats gathering via `disable()`.
+ */
+static StatsWrapperObject *registry_head = NULL;
+static int stats_enabled = 1;
+static uint64_t last_wrapper_id = 0;
+
+#ifdef Py_GIL_DISABLED
+static PyMutex registry_mutex = {0};
+#define REGISTRY_LOCK() PyMutex_Lock(&registry_mutex)
+#define REGISTRY_UNLOCK() PyMutex_Unlock(&registry_mutex)
+#else
+#define REGISTRY_LOCK()
+#define REGISTRY_UNLOCK()
+#endif
+
+
+/*
+ * Shared counter arena: once `_export_counters()` is called, the counter
+ * blocks of all wrappers are allocated in a single (shared memory) buffer,
+ * so that another process can map it and read the counters at any time
+ * without involving this process.  The buffer starts with a self-describing
+ * header, followed by `max_entries` entries naming each wrapper and giving
+ * the offset of its counter blocks (COUNTER_SHARDS blocks of `stride` bytes
+ * to be summed up) and of its histograms once allocated.  The rest is bump
+ * allocated for the counter blocks and histograms, memory is not reused when a wrapper is deallocated (its `offset` is set to
+ * 0).  Entries are published by incrementing `n_entries` last.
+ * If the arena is full, counters are allocated privately as usual.
+ */
+#define ARENA_MAGIC "TLMARENA"
+#define ARENA_VERSION 2
+#define ARENA_NAME_SIZE 104
+
+typedef struct {
+    char magic[8];
+    uint64_t version;
+    uint64_t header_size;
+    uint64_t arena_size;
+    uint64_t pid;
+    uint64_t max_entries;
+    uint64_t n_entries;
+    uint64_t data_used;
+    uint64_t dropped;  // wrappers that did not fit
+    uint64_t entries_offset;
+    uint64_t entry_size;
+    uint64_t shards;
+    uint64_t counter_size;  // size of the (non time) counters
+    uint64_t hist_buckets;
+    uint64_t hist_sub_bits;
+    uint64_t hist_stride;
+    /* Offsets of the fields within each counter block */
+    uint64_t off_total_calls;
+    uint64_t off_invalid_args;
+    uint64_t off_error_results;
+    uint64_t off_timed_calls;
+    uint64_t off_total_time;
+    uint64_t off_min_time;
+    uint64_t off_max_time;
+    uint64_t off_est_total_time;
+} arena_header;
+
+typedef struct {
+    uint64_t offset;  // offset of the counter blocks, 0 once deallocated
+    uint64_t stride;
+    /* Offset of the histograms (COUNTER_SHARDS of `hist_stride`) or 0 */
+    uint64_t hist_offset;
+    char name[ARENA_NAME_SIZE];  // NUL terminated (and truncated) UTF-8
+} arena_entry;
+
+static Py_buffer arena_view;
+static arena_header *arena = NULL;
+
+/*
+ * Counter blocks and histograms replaced when moving into the arena.  Calls
+ * in progress may still write to them, so they are only freed with the
+ * module.
+ */
+typedef struct retired_counters {
+    struct retired_counters *next;
+    void *alloc;
+} retired_counters;
+
+static retired_counters *retired_head = NULL;
+
+
+/* If even the list entry cannot be allocated, the block is leaked. */
+static void
+retire_counters(void *alloc)
+{
+    retired_counters *retired = PyMem_RawMalloc(sizeof(retired_counters));
+    if (retired != NULL) {
+        retired->alloc = alloc;
+        retired->next = retired_head;
+        retired_head = retired;
+    }
+}
+
+
+static inline arena_entry *
+get_arena_entry(Py_ssize_t index)
+{
+    return (arena_entry *)((char *)arena + arena->entries_offset) + index;
+}
+
+
+/*
+ * The `module.qualname` of the wrapped callable as UTF-8 (truncated to fit an
+ * arena entry), allocated with PyMem_Malloc.  Computed once on creation, as
+ * it may run arbitrary code (which must never happen under the registry
+ * lock).  Returns NULL only if out of memory, other errors are ignored.
+ */
+static char *
+wrapper_name(PyObject *wrapped)
+{
+    PyObject *module = PyObject_GetAttrString(wrapped, "__module__");
+    PyObject *name = PyObject_GetAttrString(wrapped, "__qualname__");
+    if (name == NULL) {
+        PyErr_Clear();
+        name = PyObject_GetAttrString(wrapped, "__name__");
+    }
+    PyObject *full = NULL;
+    if (module != NULL && name != NULL && PyUnicode_Check(module)) {
+        full = PyUnicode_FromFormat("%U.%S", module, name);
+    }
+    else if (name != NULL) {
+        full = PyObject_Str(name);
+    }
+    else {
+        PyErr_Clear();
+        full = PyObject_Repr(wrapped);
+    }
+    const char *utf8 = full != NULL ? PyUnicode_AsUTF8(full) : NULL;
+    if (utf8 == NULL) {
+        utf8 = "<unknown>";
+    }
+    PyErr_Clear();
+    size_t len = strlen(utf8);
+    if (len > ARENA_NAME_SIZE - 1) {
+        len = ARENA_NAME_SIZE - 1;
+    }
+    char *res = PyMem_Malloc(len + 1);
+    if (res != NULL) {
+        memcpy(res, utf8, len);
+        res[len] = '\0';
+    }
+    Py_XDECREF(module);
+    Py_XDECREF(name);
+    Py_XDECREF(full);
+    if (res == NULL) {
+        PyErr_NoMemory();
+    }
+    return res;
+}
+
+
+/* Bump allocate `size` zeroed bytes in the arena, returns 0 if it is full */
+static uint64_t
+arena_bump(uint64_t size)
+{
+    if (arena->data_used + size > arena->arena_size) {
+        return 0;
+    }
+    uint64_t offset = arena->data_used;
+    arena->data_used += size;
+    memset((char *)arena + offset, 0, size);
+    return offset;
+}
+
+
+/*
+ * Allocate the counter blocks of `self` (COUNTER_SHARDS of `stride` bytes)
+ * in the arena, updating or creating its entry.  Returns NULL if the arena
+ * is not used or full.  Must be called with the registry lock held.
+ */
+static char *
+arena_allocate(StatsWrapperObject *self, Py_ssize_t stride)
+{
+    if (arena == NULL) {
+        return NULL;
+    }
+    if (self->arena_entry < 0 && arena->n_entries >= arena->max_entries) {
+        arena->dropped++;
+        return NULL;
+    }
+    uint64_t offset = arena_bump((uint64_t)stride * COUNTER_SHARDS);
+    if (offset == 0) {
+        arena->dropped++;
+        return NULL;
+    }
+    char *counters = (char *)arena + offset;
+
+    if (self->arena_entry >= 0) {
+        /* Layout changed, the reader just sees the new (zeroed) blocks. */
+        arena_entry *entry = get_arena_entry(self->arena_entry);
+        entry->stride = stride;
+        entry->offset = offset;
+        return counters;
+    }
+    Py_ssize_t index = (Py_ssize_t)arena->n_entries;
+    arena_entry *entry = get_arena_entry(index);
+    strcpy(entry->name, self->name);
+    entry->stride = stride;
+    entry->hist_offset = 0;
+    entry->offset = offset;
+#ifdef Py_GIL_DISABLED
+    _Py_atomic_store_uint64_release(&arena->n_entries, index + 1);
+#else
+    arena->n_entries = index + 1;
+#endif
+    self->arena_entry = index;
+    return counters;
+}
+
+
+/*
+ * Allocate the histograms of `self` next to its counters in the arena.
+ * Returns NULL if they are not in the arena or it is full.  Must be called
+ * with the registry lock held.
+ */
+static char *
+arena_allocate_histograms(StatsWrapperObject *self)
+{
+    if (arena == NULL || self->arena_entry < 0) {
+        return NULL;
+    }
+    uint64_t offset = arena_bump((uint64_t)HIST_STRIDE * COUNTER_SHARDS);
+    if (offset == 0) {
+        return NULL;
+    }
+    get_arena_entry(self->arena_entry)->hist_offset = offset;
+    return (char *)arena + offset;
+}
+
+
+static void
+arena_release(StatsWrapperObject *self)
+{
+    if (self->arena_entry >= 0) {
+        get_arena_entry(self->arena_entry)->offset = 0;
+        self->arena_entry = -1;
+    }
+}
+
+
+#if !defined(HAVE_PYTIME_PERFCOUNTER) && defined(_WIN32)
+static LARGE_INTEGER perf_frequency;
+#endif
+
+
+/*
+ * Monotonic clock in nanoseconds.  This is the same clock that
+ * `time.perf_counter()` uses, but we read it directly to avoid creating
+ * a Python float twice for every call.  It cannot fail.
+ */
+static inline int64_t
+monotonic_ns(void)
+{
+#if defined(HAVE_PYTIME_PERFCOUNTER)
+    PyTime_t t;
+    (void)PyTime_PerfCounterRaw(&t);
+    return (int64_t)t;
+#elif defined(_WIN32)
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    /* Split to avoid overflowing the multiplication */
+    int64_t sec = ticks.QuadPart / perf_frequency.QuadPart;
+    int64_t rem = ticks.QuadPart % perf_frequency.QuadPart;
+    return sec * 1000000000 + rem * 1000000000 / perf_frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+/*
+ * CPU time used by the current thread in nanoseconds (on Linux, a vDSO call
+ * like the monotonic clock).  Windows only counts in scheduler ticks.
+ */
+#if defined(_WIN32) || defined(CLOCK_THREAD_CPUTIME_ID)
+#define HAVE_THREAD_CPU_TIME
+
+static inline int64_t
+thread_cpu_ns(void)
+{
+#ifdef _WIN32
+    FILETIME creation_time, exit_time, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel, &user);
+    int64_t ticks = (((int64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime)
+                    + (((int64_t)user.dwHighDateTime << 32) | user.dwLowDateTime);
+    return ticks * 100;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+#else
+static inline int64_t
+thread_cpu_ns(void)
+{
+    return 0;  /* `_enable_cpu_time()` refuses */
+}
+#endif
+
+
+#ifdef Py_GIL_DISABLED
+static Py_ssize_t next_shard = 0;
+static THREAD_LOCAL Py_ssize_t thread_shard = -1;
+#endif
+
+
+/*
+ * Return the counter block for the current thread.  Threads are assigned
+ * shards round-robin on first use.
+ */
+static inline statscounters *
+get_counters(StatsWrapperObject *self)
+{
+#ifdef Py_GIL_DISABLED
+    Py_ssize_t shard = thread_shard;
+    if (shard < 0) {
+        shard = _Py_atomic_add_ssize(&next_shard, 1) % COUNTER_SHARDS;
+        thread_shard = shard;
+    }
+    return (statscounters *)(self->counters + shard * self->counters_stride);
+#else
+    return (statscounters *)self->counters;
+#endif
+}
+
+
+static inline statscounters *
+get_shard(StatsWrapperObject *self, Py_ssize_t shard)
+{
+    return (statscounters *)(self->counters + shard * self->counters_stride);
+}
+
+
+static inline void
+counter_min64(int64_t *field, int64_t value)
+{
+#ifdef Py_GIL_DISABLED
+    int64_t curr = _Py_atomic_load_int64_relaxed(field);
+    while (value < curr) {
+        if (_Py_atomic_compare_exchange_int64(field, &curr, value)) {
+            break;
+        }
+    }
+#else
+    if (value < *field) {
+        *field = value;
+    }
+#endif
+}
+
+
+static inline void
+counter_max64(int64_t *field, int64_t value)
+{
+#ifdef Py_GIL_DISABLED
+    int64_t curr = _Py_atomic_load_int64_relaxed(field);
+    while (value > curr) {
+        if (_Py_atomic_compare_exchange_int64(field, &curr, value)) {
+            break;
+        }
+    }
+#else
+    if (value > *field) {
+        *field = value;
+    }
+#endif
+}
+
+
+static inline int
+log2_floor64(uint64_t value)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long idx;
+    _BitScanReverse64(&idx, value);
+    return (int)idx;
+#elif defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    int res = 0;
+    while (value >>= 1) {
+        res++;
+    }
+    return res;
+#endif
+}
+
+
+/*
+ * Histogram bucket for a duration, values below HIST_SUB_COUNT get a bucket
+ * each, after that every power of two gets HIST_SUB_COUNT buckets.
+ */
+static inline Py_ssize_t
+histogram_bucket(int64_t value)
+{
+    if (value < HIST_SUB_COUNT) {
+        return value < 0 ? 0 : (Py_ssize_t)value;
+    }
+    if (value >= ((int64_t)1 << HIST_MAX_LOG2)) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = log2_floor64((uint64_t)value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (Py_ssize_t)(value >> shift) - HIST_SUB_COUNT;
+}
+
+
+/* Smallest value that ends up in the given bucket. */
+static int64_t
+histogram_bucket_start(Py_ssize_t bucket)
+{
+    if (bucket < HIST_SUB_COUNT) {
+        return bucket;
+    }
+    int shift = (int)(bucket / HIST_SUB_COUNT) - 1;
+    return (int64_t)(bucket % HIST_SUB_COUNT + HIST_SUB_COUNT) << shift;
+}
+
+
+/*
+ * QuantileSketch implementation
+ */
+
+static PyTypeObject QuantileSketch_Type;
+
+#define SKETCH_MAGIC "DDS1"
+
+
+/* Set `gamma` and everything derived from it */
+static void
+sketch_set_gamma(QuantileSketchObject *sketch, double gamma)
+{
+    sketch->gamma = gamma;
+    sketch->log_gamma = log(gamma);
+    /* Smallest value whose key still fits into an int32 */
+    sketch->min_indexable = exp((INT32_MIN + 1) * sketch->log_gamma);
+    if (sketch->min_indexable < DBL_MIN * sketch->gamma) {
+        sketch->min_indexable = DBL_MIN * sketch->gamma;
+    }
+}
+
+
+static QuantileSketchObject *
+sketch_new(double relative_accuracy, Py_ssize_t max_bins)
+{
+    if (!(relative_accuracy > 0 && relative_accuracy < 1)) {
+        PyErr_SetString(PyExc_ValueError,
+                "relative_accuracy must be between 0 and 1.");
+        return NULL;
+    }
+    if (max_bins < 1) {
+        PyErr_SetString(PyExc_ValueError, "max_bins must be positive.");
+        return NULL;
+    }
+    QuantileSketchObject *sketch = PyObject_New(
+            QuantileSketchObject, &QuantileSketch_Type);
+    if (sketch == NULL) {
+        return NULL;
+    }
+    sketch_set_gamma(sketch, (1 + relative_accuracy) / (1 - relative_accuracy));
+    sketch->max_bins = max_bins;
+    sketch->count = 0;
+    sketch->zero_count = 0;
+    sketch->min = 0;
+    sketch->max = 0;
+    sketch->min_key = 0;
+    sketch->nbins = 0;
+    sketch->bins = NULL;
+#ifdef Py_GIL_DISABLED
+    memset(&sketch->mutex, 0, sizeof(PyMutex));
+#endif
+    return sketch;
+}
+
+
+/*
+ * Make the bins cover [new_min, new_max].  If that is more than `max_bins`,
+ * the lowest keys are collapsed into the lowest remaining bin.
+ */
+static int
+sketch_resize(QuantileSketchObject *sketch, int64_t new_min, int64_t new_max)
+{
+    if (new_max - new_min + 1 > sketch->max_bins) {
+        new_min = new_max - sketch->max_bins + 1;
+    }
+    Py_ssize_t nbins = (Py_ssize_t)(new_max - new_min + 1);
+    uint64_t *bins = PyMem_Calloc(nbins, sizeof(uint64_t));
+    if (bins == NULL) {
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < sketch->nbins; i++) {
+        int64_t key = sketch->min_key + i;
+        if (key < new_min) {
+            key = new_min;
+        }
+        bins[key - new_min] += sketch->bins[i];
+    }
+    PyMem_Free(sketch->bins);
+    sketch->bins = bins;
+    sketch->nbins = nbins;
+    sketch->min_key = (int32_t)new_min;
+    return 0;
+}
+
+
+/* Add `n` to the bin of `key`, returns -1 (without an error) if OOM. */
+static int
+sketch_add_key(QuantileSketchObject *sketch, int32_t key, uint64_t n)
+{
+    if (sketch->nbins == 0) {
+        if (sketch_resize(sketch, key, key) < 0) {
+            return -1;
+        }
+    }
+    else {
+        int64_t max_key = (int64_t)sketch->min_key + sketch->nbins - 1;
+        if (key > max_key) {
+            if (sketch_resize(sketch, sketch->min_key, key) < 0) {
+                return -1;
+            }
+        }
+        else if (key < sketch->min_key &&
+                 max_key - key + 1 <= sketch->max_bins) {
+            if (sketch_resize(sketch, key, max_key) < 0) {
+                return -1;
+            }
+        }
+    }
+    if (key < sketch->min_key) {
+        key = sketch->min_key;  /* collapsed */
+    }
+    sketch->bins[key - sketch->min_key] += n;
+    return 0;
+}
+
+
+static void
+sketch_update_minmax(QuantileSketchObject *sketch, double min, double max)
+{
+    if (sketch->count == 0 || min < sketch->min) {
+        sketch->min = min;
+    }
+    if (sketch->count == 0 || max > sketch->max) {
+        sketch->max = max;
+    }
+}
+
+
+/* Record a (non-negative) value, returns -1 (without an error) if OOM. */
+static int
+sketch_add(QuantileSketchObject *sketch, double value)
+{
+    if (value < sketch->min_indexable) {
+        sketch->zero_count++;
+    }
+    else {
+        int32_t key = (int32_t)ceil(log(value) / sketch->log_gamma);
+        if (sketch_add_key(sketch, key, 1) < 0) {
+            return -1;
+        }
+    }
+    sketch_update_minmax(sketch, value, value);
+    sketch->count++;
+    return 0;
+}
+
+
+static double
+sketch_quantile(QuantileSketchObject *sketch, double q)
+{
+    if (sketch->count == 0) {
+        return 0.0;
+    }
+    double rank = q * (double)(sketch->count - 1);
+    double cumulative = (double)sketch->zero_count;
+    double value = 0.0;
+    if (cumulative <= rank) {
+        Py_ssize_t i = 0;
+        for (; i < sketch->nbins - 1; i++) {
+            cumulative += (double)sketch->bins[i];
+            if (cumulative > rank) {
+                break;
+            }
+        }
+        value = 2 * exp((sketch->min_key + i) * sketch->log_gamma)
+                / (1 + sketch->gamma);
+    }
+    if (value < sketch->min) {
+        value = sketch->min;
+    }
+    if (value > sketch->max) {
+        value = sketch->max;
+    }
+    return value;
+}
+
+
+static int
+sketch_merge(QuantileSketchObject *sketch, QuantileSketchObject *other)
+{
+    if (sketch->gamma != other->gamma) {
+        PyErr_SetString(PyExc_ValueError,
+                "can only merge sketches with the same relative accuracy.");
+        return -1;
+    }
+    if (other->nbins > 0) {
+        int64_t other_max = (int64_t)other->min_key + other->nbins - 1;
+        int64_t new_min = other->min_key;
+        int64_t new_max = other_max;
+        if (sketch->nbins > 0) {
+            int64_t max_key = (int64_t)sketch->min_key + sketch->nbins - 1;
+            new_min = sketch->min_key < new_min ? sketch->min_key : new_min;
+            new_max = max_key > new_max ? max_key : new_max;
+        }
+        if (sketch_resize(sketch, new_min, new_max) < 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (Py_ssize_t i = 0; i < other->nbins; i++) {
+            int64_t key = other->min_key + i;
+            if (key < sketch->min_key) {
+                key = sketch->min_key;
+            }
+            sketch->bins[key - sketch->min_key] += other->bins[i];
+        }
+    }
+    if (other->count > 0) {
+        sketch_update_minmax(sketch, other->min, other->max);
+    }
+    sketch->zero_count += other->zero_count;
+    sketch->count += other->count;
+    return 0;
+}
+
+
+/*
+ * Serialization: the magic, gamma, min and max as little-endian doubles,
+ * followed by max_bins, zero_count, min_key (zigzag encoded), nbins and the
+ * bin counts as LEB128 varints.  Most bins are small, so this is compact.
+ */
+static char *
+write_varint(char *p, uint64_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (char)value;
+    return p;
+}
+
+
+static const char *
+read_varint(const char *p, const char *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char byte = (unsigned char)*p++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+static char *
+write_double(char *p, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) {
+        *p++ = (char)(bits >> (8 * i));
+    }
+    return p;
+}
+
+
+static const char *
+read_double(const char *p, const char *end, double *value)
+{
+    if (end - p < 8) {
+        return NULL;
+    }
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+        bits |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    }
+    memcpy(value, &bits, sizeof(bits));
+    return p + 8;
+}
+
+
+static PyObject *
+sketch_to_bytes(QuantileSketchObject *sketch, PyObject *unused)
+{
+    SKETCH_LOCK(sketch);
+    /* Upper bound: 3 doubles and at most 10 bytes for each varint */
+    Py_ssize_t size = 4 + 3 * 8 + (4 + sketch->nbins) * 10;
+    char *buf = PyMem_Malloc(size);
+    if (buf == NULL) {
+        SKETCH_UNLOCK(sketch);
+        return PyErr_NoMemory();
+    }
+    char *p = buf;
+    memcpy(p, SKETCH_MAGIC, 4);
+    p += 4;
+    p = write_double(p, sketch->gamma);
+    p = write_double(p, sketch->min);
+    p = write_double(p, sketch->max);
+    p = write_varint(p, (uint64_t)sketch->max_bins);
+    p = write_varint(p, sketch->zero_count);
+    uint32_t min_key = (uint32_t)sketch->min_key;
+    p = write_varint(p, (min_key << 1) ^ (uint32_t)(sketch->min_key >> 31));
+    p = write_varint(p, (uint64_t)sketch->nbins);
+    for (Py_ssize_t i = 0; i < sketch->nbins; i++) {
+        p = write_varint(p, sketch->bins[i]);
+    }
+    SKETCH_UNLOCK(sketch);
+    PyObject *res = PyBytes_FromStringAndSize(buf, p - buf);
+    PyMem_Free(buf);
+    return res;
+}
+
+
+static PyObject *
+sketch_from_bytes(PyObject *cls, PyObject *arg)
+{
+    Py_buffer view;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    const char *p = view.buf;
+    const char *end = p + view.len;
+    QuantileSketchObject *sketch = NULL;
+    double gamma, min, max;
+    uint64_t max_bins, zero_count, zz_min_key, nbins;
+
+    if (view.len < 4 || memcmp(p, SKETCH_MAGIC, 4) != 0) {
+        goto invalid;
+    }
+    p += 4;
+    if ((p = read_double(p, end, &gamma)) == NULL ||
+            (p = read_double(p, end, &min)) == NULL ||
+            (p = read_double(p, end, &max)) == NULL ||
+            (p = read_varint(p, end, &max_bins)) == NULL ||
+            (p = read_varint(p, end, &zero_count)) == NULL ||
+            (p = read_varint(p, end, &zz_min_key)) == NULL ||
+            (p = read_varint(p, end, &nbins)) == NULL) {
+        goto invalid;
+    }
+    if (!(gamma > 1) || max_bins < 1 || max_bins > PY_SSIZE_T_MAX ||
+            nbins > max_bins || nbins > (uint64_t)(end - p) ||
+            zz_min_key > UINT32_MAX) {
+        goto invalid;
+    }
+    sketch = sketch_new((gamma - 1) / (gamma + 1), (Py_ssize_t)max_bins);
+    if (sketch == NULL) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    /* Use the exact gamma, it is compared when merging */
+    sketch_set_gamma(sketch, gamma);
+    int32_t min_key = (int32_t)((uint32_t)(zz_min_key >> 1) ^ -(uint32_t)(zz_min_key & 1));
+    if (nbins > 0) {
+        if ((int64_t)min_key + (int64_t)nbins - 1 > INT32_MAX) {
+            goto invalid;
+        }
+        if (sketch_resize(sketch, min_key, (int64_t)min_key + nbins - 1) < 0) {
+            PyBuffer_Release(&view);
+            Py_DECREF(sketch);
+            return PyErr_NoMemory();
+        }
+    }
+    uint64_t count = zero_count;
+    for (uint64_t i = 0; i < nbins; i++) {
+        if ((p = read_varint(p, end, &sketch->bins[i])) == NULL) {
+            goto invalid;
+        }
+        count += sketch->bins[i];
+    }
+    if (p != end) {
+        goto invalid;
+    }
+    sketch->zero_count = zero_count;
+    sketch->count = count;
+    sketch->min = min;
+    sketch->max = max;
+    PyBuffer_Release(&view);
+    return (PyObject *)sketch;
+
+  invalid:
+    PyBuffer_Release(&view);
+    Py_XDECREF(sketch);
+    PyErr_SetString(PyExc_ValueError, "invalid QuantileSketch data.");
+    return NULL;
+}
+
+
+static PyObject *
+sketch_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"relative_accuracy", "max_bins", NULL};
+    double relative_accuracy = 0.01;
+    Py_ssize_t max_bins = 2048;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dn:QuantileSketch", kwlist,
+            &relative_accuracy, &max_bins)) {
+        return NULL;
+    }
+    return (PyObject *)sketch_new(relative_accuracy, max_bins);
+}
+
+
+static void
+sketch_dealloc(QuantileSketchObject *sketch)
+{
+    PyMem_Free(sketch->bins);
+    PyObject_Free(sketch);
+}
+
+
+static PyObject *
+sketch_copy(QuantileSketchObject *sketch, PyObject *Py_UNUSED(ignored))
+{
+    QuantileSketchObject *res = sketch_new(0.5, sketch->max_bins);
+    if (res == NULL) {
+        return NULL;
+    }
+    res->gamma = sketch->gamma;
+    res->log_gamma = sketch->log_gamma;
+    res->min_indexable = sketch->min_indexable;
+    SKETCH_LOCK(sketch);
+    int err = sketch_merge(res, sketch);
+    SKETCH_UNLOCK(sketch);
+    if (err < 0) {
+        Py_DECREF(res);
+        return NULL;
+    }
+    return (PyObject *)res;
+}
+
+
+/*
+ * Move the contents of `sketch` into a new sketch, leaving it empty.
+ */
+static QuantileSketchObject *
+sketch_take(QuantileSketchObject *sketch)
+{
+    QuantileSketchObject *res = sketch_new(0.5, sketch->max_bins);
+    if (res == NULL) {
+        return NULL;
+    }
+    res->gamma = sketch->gamma;
+    res->log_gamma = sketch->log_gamma;
+    res->min_indexable = sketch->min_indexable;
+    SKETCH_LOCK(sketch);
+    res->count = sketch->count;
+    res->zero_count = sketch->zero_count;
+    res->min = sketch->min;
+    res->max = sketch->max;
+    res->min_key = sketch->min_key;
+    res->nbins = sketch->nbins;
+    res->bins = sketch->bins;
+    sketch->count = sketch->zero_count = 0;
+    sketch->min = sketch->max = 0;
+    sketch->min_key = 0;
+    sketch->nbins = 0;
+    sketch->bins = NULL;
+    SKETCH_UNLOCK(sketch);
+    return res;
+}
+
+
+static PyObject *
+sketch_py_add(QuantileSketchObject *sketch, PyObject *arg)
+{
+    double value = PyFloat_AsDouble(arg);
+    if (value == -1.0 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (!(value >= 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                "QuantileSketch only supports non-negative values.");
+        return NULL;
+    }
+    SKETCH_LOCK(sketch);
+    int err = sketch_add(sketch, value);
+    SKETCH_UNLOCK(sketch);
+    if (err < 0) {
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+sketch_py_merge(QuantileSketchObject *sketch, PyObject *other)
+{
+    if (!PyObject_TypeCheck(other, &QuantileSketch_Type)) {
+        PyErr_SetString(PyExc_TypeError, "can only merge a QuantileSketch.");
+        return NULL;
+    }
+    /* Merge a copy, so that we never hold both locks. */
+    QuantileSketchObject *copy = (QuantileSketchObject *)sketch_copy(
+            (QuantileSketchObject *)other, NULL);
+    if (copy == NULL) {
+        return NULL;
+    }
+    SKETCH_LOCK(sketch);
+    int err = sketch_merge(sketch, copy);
+    SKETCH_UNLOCK(sketch);
+    Py_DECREF(copy);
+    if (err < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+sketch_py_quantile(QuantileSketchObject *sketch, PyObject *arg)
+{
+    double q = PyFloat_AsDouble(arg);
+    if (q == -1.0 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (!(q >= 0 && q <= 1)) {
+        PyErr_SetString(PyExc_ValueError, "quantile must be between 0 and 1.");
+        return NULL;
+    }
+    SKETCH_LOCK(sketch);
+    double res = sketch_quantile(sketch, q);
+    SKETCH_UNLOCK(sketch);
+    return PyFloat_FromDouble(res);
+}
+
+
+static PyObject *
+sketch_reduce(QuantileSketchObject *sketch, PyObject *unused)
+{
+    PyObject *data = sketch_to_bytes(sketch, NULL);
+    if (data == NULL) {
+        return NULL;
+    }
+    PyObject *from_bytes = PyObject_GetAttrString(
+            (PyObject *)Py_TYPE(sketch), "from_bytes");
+    if (from_bytes == NULL) {
+        Py_DECREF(data);
+        return NULL;
+    }
+    return Py_BuildValue("N(N)", from_bytes, data);
+}
+
+
+static PyObject *
+sketch_get_count(QuantileSketchObject *sketch, void *unused)
+{
+    SKETCH_LOCK(sketch);
+    uint64_t count = sketch->count;
+    SKETCH_UNLOCK(sketch);
+    return PyLong_FromUnsignedLongLong(count);
+}
+
+
+static PyObject *
+sketch_get_relative_accuracy(QuantileSketchObject *sketch, void *unused)
+{
+    return PyFloat_FromDouble((sketch->gamma - 1) / (sketch->gamma + 1));
+}
+
+
+static struct PyGetSetDef sketch_getset[] = {
+    {"count", (getter)sketch_get_count, 0, NULL, 0},
+    {"relative_accuracy", (getter)sketch_get_relative_accuracy, 0, NULL, 0},
+    {0, 0, 0, 0, 0}
+};
+
+
+static PyMethodDef sketch_methods[] = {
+    {"add", (PyCFunction)sketch_py_add, METH_O, NULL},
+    {"merge", (PyCFunction)sketch_py_merge, METH_O, NULL},
+    {"quantile", (PyCFunction)sketch_py_quantile, METH_O, NULL},
+    {"copy", (PyCFunction)sketch_copy, METH_NOARGS, NULL},
+    {"to_bytes", (PyCFunction)sketch_to_bytes, METH_NOARGS, NULL},
+    {"from_bytes", (PyCFunction)sketch_from_bytes, METH_O | METH_CLASS, NULL},
+    {"__reduce__", (PyCFunction)sketch_reduce, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject QuantileSketch_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "telemetric.statswrapper._stats_wrapper.QuantileSketch",
+    .tp_basicsize = sizeof(QuantileSketchObject),
+    .tp_dealloc = (destructor)sketch_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = sketch_tp_new,
+    .tp_getset = sketch_getset,
+    .tp_methods = sketch_methods,
+};
+
+
+/*
+ * Errors while comparing or hashing tracked values are ignored, except for
+ * these critical ones.
+ */
+static inline int
+is_critical_error(void)
+{
+    return (PyErr_ExceptionMatches(PyExc_RecursionError) ||
+            PyErr_ExceptionMatches(PyExc_MemoryError) ||
+            PyErr_ExceptionMatches(PyExc_KeyboardInterrupt));
+}
+
+
+static inline int
+param_equal(PyObject *param, PyObject *arg)
+{
+    int eq = PyObject_RichCompareBool(param, arg, Py_EQ);
+    if (eq < 0) {
+        if (is_critical_error()) {
+            return -1;
+        }
+        // Just ignore all but the most critical errors here...
+        PyErr_Clear();
+        return 0;
+    }
+    return eq;
+}
+
+
+/*
+ * Find the first occurrence of `ptr` in the array of `n` pointers, or -1.
+ * Compares 4 (AVX2) or 2 (SSE2, NEON) pointers at once where available.
+ */
+static inline Py_ssize_t
+find_pointer(PyObject *const *items, Py_ssize_t n, PyObject *ptr)
+{
+    Py_ssize_t i = 0;
+#if defined(POINTER_SCAN_AVX2)
+    __m256i needle = _mm256_set1_epi64x((long long)(intptr_t)ptr);
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(items + i));
+        int mask = _mm256_movemask_pd(
+                _mm256_castsi256_pd(_mm256_cmpeq_epi64(v, needle)));
+        if (mask) {
+            return i + (mask & 1 ? 0 : mask & 2 ? 1 : mask & 4 ? 2 : 3);
+        }
+    }
+#elif defined(POINTER_SCAN_SSE2)
+    __m128i needle = _mm_set1_epi64x((long long)(intptr_t)ptr);
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(items + i));
+        /* SSE2 has no 64bit compare, both 32bit halves have to match */
+        __m128i eq = _mm_cmpeq_epi32(v, needle);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask) {
+            return i + (mask & 1 ? 0 : 1);
+        }
+    }
+#elif defined(POINTER_SCAN_NEON)
+    uint64x2_t needle = vdupq_n_u64((uint64_t)(uintptr_t)ptr);
+    for (; i + 2 <= n; i += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64((const uint64_t *)(items + i)), needle);
+        if (vgetq_lane_u64(eq, 0)) {
+            return i;
+        }
+        if (vgetq_lane_u64(eq, 1)) {
+            return i + 1;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (items[i] == ptr) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static int tuple_has_builtin_hash(PyObject *tuple);
+
+
+/*
+ * Whether equal objects of these types have equal hashes, so they can be
+ * found through the hash table.  Other types may compare equal to values
+ * with a different hash (e.g. NumPy dtypes to their names), so tuples only
+ * qualify if all their elements do.
+ */
+static inline int
+has_builtin_hash(PyObject *obj)
+{
+    PyTypeObject *type = Py_TYPE(obj);
+    if (type == &PyTuple_Type) {
+        return tuple_has_builtin_hash(obj);
+    }
+    return (type == &PyUnicode_Type || type == &PyLong_Type ||
+            type == &PyFloat_Type || type == &PyBool_Type ||
+            obj == Py_None);
+}
+
+
+static int
+tuple_has_builtin_hash(PyObject *tuple)
+{
+    if (Py_EnterRecursiveCall(" in has_builtin_hash")) {
+        PyErr_Clear();
+        return 0;  /* too deeply nested, compare it one by one */
+    }
+    int res = 1;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(tuple) && res; i++) {
+        res = has_builtin_hash(PyTuple_GET_ITEM(tuple, i));
+    }
+    Py_LeaveRecursiveCall();
+    return res;
+}
+
+
+/*
+ * Find the index of `arg` in `known_params`.  Returns -1 if it is not
+ * tracked and -2 on (critical) errors.
+ */
+static inline Py_ssize_t
+find_known_param(arginfo *arginfo, argspec *spec, PyObject *arg)
+{
+    Py_ssize_t n_params = PyTuple_GET_SIZE(arginfo->known_params);
+    PyObject *const *params = ((PyTupleObject *)arginfo->known_params)->ob_item;
+
+    /*
+     * Most calls pass the same (often singleton or interned) object as the
+     * last call, so check that first and then do a fast identity scan.
+     */
+    Py_ssize_t last_hit = COUNTER_LOAD(arginfo->last_hit);
+    if (last_hit < n_params && params[last_hit] == arg) {
+        return last_hit;
+    }
+    Py_ssize_t idx = find_pointer(params, n_params, arg);
+    if (idx >= 0) {
+        COUNTER_STORE(arginfo->last_hit, idx);
+        return idx;
+    }
+
+    if (arginfo->param_table != NULL && has_builtin_hash(arg)) {
+        Py_hash_t hash = PyObject_Hash(arg);
+        if (hash != -1) {
+            size_t i = (size_t)hash & arginfo->param_mask;
+            for (; arginfo->param_table[i].index >= 0;
+                    i = (i + 1) & arginfo->param_mask) {
+                if (arginfo->param_table[i].hash != hash) {
+                    continue;
+                }
+                Py_ssize_t idx = arginfo->param_table[i].index;
+                int eq = param_equal(params[idx], arg);
+                if (eq < 0) {
+                    return -2;
+                }
+                if (eq) {
+                    return idx;
+                }
+            }
+            /* Only the tracked values not in the table are left to check */
+            for (Py_ssize_t j = 0; j < spec->n_unhashed; j++) {
+                Py_ssize_t idx = spec->unhashed[j];
+                int eq = param_equal(params[idx], arg);
+                if (eq < 0) {
+                    return -2;
+                }
+                if (eq) {
+                    return idx;
+                }
+            }
+            return -1;
+        }
+        if (is_critical_error()) {
+            return -2;
+        }
+        /* The argument is unhashable, fall back to comparing all. */
+        PyErr_Clear();
+    }
+
+    for (Py_ssize_t idx = 0; idx < n_params; idx++) {
+        int eq = param_equal(params[idx], arg);
+        if (eq < 0) {
+            return -2;
+        }
+        if (eq) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+
+static inline void
+record_type(statscounters *counters, arginfo *arginfo, PyTypeObject *type)
+{
+    size_t i = ((uintptr_t)type >> 4) & (TYPE_TABLE_SIZE - 1);
+    for (int probe = 0; probe < TYPE_TABLE_SIZE;
+            probe++, i = (i + 1) & (TYPE_TABLE_SIZE - 1)) {
+#ifdef Py_GIL_DISABLED
+        PyTypeObject *entry = _Py_atomic_load_ptr_relaxed(&arginfo->types[i]);
+        if (entry == NULL && COUNTER_LOAD(arginfo->n_types) < TYPE_TABLE_MAX) {
+            /* Try to insert, if another thread won, check what it inserted */
+            if (_Py_atomic_compare_exchange_ptr(&arginfo->types[i], &entry, type)) {
+                Py_INCREF(type);
+                COUNTER_ADD(arginfo->n_types, 1);
+                entry = type;
+            }
+        }
+#else
+        PyTypeObject *entry = arginfo->types[i];
+        if (entry == NULL && arginfo->n_types < TYPE_TABLE_MAX) {
+            Py_INCREF(type);
+            arginfo->types[i] = type;
+            arginfo->n_types++;
+            entry = type;
+        }
+#endif
+        if (entry == type) {
+            COUNTER_ADD64(counters->slots[arginfo->type_slots + i], 1);
+            return;
+        }
+        if (entry == NULL) {
+            break;  /* the table is full */
+        }
+    }
+    COUNTER_ADD64(counters->slots[arginfo->type_slots + TYPE_TABLE_SIZE], 1);
+}
+
+
+static PyObject *str_array_interface = NULL;
+
+
+static void
+record_dtype(statscounters *counters, arginfo *arginfo, const char *format)
+{
+    Py_ssize_t dtype_slots = arginfo->array_slots + ARRAY_DTYPE_OFFSET;
+    for (Py_ssize_t i = 0; i < DTYPE_TABLE_MAX; i++) {
+#ifdef Py_GIL_DISABLED
+        PyObject *dtype = _Py_atomic_load_ptr_acquire(&arginfo->dtypes[i]);
+#else
+        PyObject *dtype = arginfo->dtypes[i];
+#endif
+        if (dtype == NULL) {
+            dtype = PyUnicode_InternFromString(format);
+            if (dtype == NULL) {
+                PyErr_Clear();
+                break;
+            }
+#ifdef Py_GIL_DISABLED
+            void *expected = NULL;
+            if (!_Py_atomic_compare_exchange_ptr(
+                    &arginfo->dtypes[i], &expected, dtype)) {
+                /* Another thread inserted one, check that one instead. */
+                Py_DECREF(dtype);
+                dtype = expected;
+            }
+#else
+            arginfo->dtypes[i] = dtype;
+#endif
+        }
+        const char *name = PyUnicode_AsUTF8(dtype);
+        if (name != NULL && strcmp(name, format) == 0) {
+            COUNTER_ADD64(counters->slots[dtype_slots + i], 1);
+            return;
+        }
+    }
+    COUNTER_ADD64(counters->slots[dtype_slots + DTYPE_TABLE_MAX], 1);
+}
+
+
+/*
+ * Find size, ndim and dtype of an argument exposing the buffer protocol or
+ * `__array_interface__` (without importing NumPy), or just its `len()`.
+ * Errors are ignored (except critical ones).  Sets `*size_slot` to the size
+ * bucket slot if it was not yet set by a previous argument.
+ */
+static int
+record_array_stats(statscounters *counters, arginfo *arginfo, PyObject *arg,
+        Py_ssize_t *size_slot)
+{
+    Py_ssize_t base = arginfo->array_slots;
+    Py_ssize_t size = -1;
+    Py_ssize_t ndim = -1;
+
+    if (PyObject_CheckBuffer(arg)) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(arg, &view, PyBUF_RECORDS_RO) == 0) {
+            size = view.itemsize > 0 ? view.len / view.itemsize : view.len;
+            ndim = view.ndim;
+            record_dtype(counters, arginfo, view.format ? view.format : "B");
+            PyBuffer_Release(&view);
+        }
+        else if (is_critical_error()) {
+            return -1;
+        }
+        else {
+            PyErr_Clear();
+        }
+    }
+    if (size < 0 && _PyType_Lookup(Py_TYPE(arg), str_array_interface) != NULL) {
+        PyObject *interface = PyObject_GetAttr(arg, str_array_interface);
+        if (interface != NULL && PyDict_Check(interface)) {
+            PyObject *shape = PyDict_GetItemString(interface, "shape");
+            PyObject *typestr = PyDict_GetItemString(interface, "typestr");
+            if (shape != NULL && PyTuple_Check(shape)) {
+                ndim = PyTuple_GET_SIZE(shape);
+                size = 1;
+                for (Py_ssize_t i = 0; i < ndim; i++) {
+                    Py_ssize_t dim = PyLong_AsSsize_t(PyTuple_GET_ITEM(shape, i));
+                    if (dim < 0) {
+                        size = -1;
+                        break;
+                    }
+                    size = (dim != 0 && size > PY_SSIZE_T_MAX / dim)
+                           ? PY_SSIZE_T_MAX : size * dim;
+                }
+            }
+            if (typestr != NULL && PyUnicode_Check(typestr)) {
+                const char *format = PyUnicode_AsUTF8(typestr);
+                if (format != NULL) {
+                    record_dtype(counters, arginfo, format);
+                }
+            }
+        }
+        Py_XDECREF(interface);
+    }
+    if (size < 0 && ndim < 0 && (
+            (Py_TYPE(arg)->tp_as_sequence != NULL &&
+                Py_TYPE(arg)->tp_as_sequence->sq_length != NULL) ||
+            (Py_TYPE(arg)->tp_as_mapping != NULL &&
+                Py_TYPE(arg)->tp_as_mapping->mp_length != NULL))) {
+        size = PyObject_Length(arg);
+    }
+    if (PyErr_Occurred()) {
+        if (is_critical_error()) {
+            return -1;
+        }
+        PyErr_Clear();
+    }
+
+    if (ndim >= 0) {
+        Py_ssize_t ndim_slot = ndim < ARRAY_NDIM_SLOTS - 1 ? ndim : ARRAY_NDIM_SLOTS - 1;
+        COUNTER_ADD64(counters->slots[base + ARRAY_NDIM_OFFSET + ndim_slot], 1);
+    }
+    if (size < 0) {
+        COUNTER_ADD64(counters->slots[base + ARRAY_UNSIZED_OFFSET], 1);
+        return 0;
+    }
+    Py_ssize_t bucket = size == 0 ? 0 : log2_floor64((uint64_t)size) + 1;
+    if (bucket >= ARRAY_SIZE_BUCKETS) {
+        bucket = ARRAY_SIZE_BUCKETS - 1;
+    }
+    COUNTER_ADD64(counters->slots[base + bucket], 1);
+    if (*size_slot < 0) {
+        *size_slot = base + bucket;
+    }
+    return 0;
+}
+
+
+static inline int
+handle_arg_stats(statscounters *counters, arginfo *arginfo, argspec *spec,
+        PyObject *arg, Py_ssize_t *size_slot)
+{
+    COUNTER_ADD64(counters->slots[arginfo->count_slot], 1);
+
+    if (arginfo->types != NULL) {
+        record_type(counters, arginfo, Py_TYPE(arg));
+    }
+    if (arginfo->dtypes != NULL) {
+        if (record_array_stats(counters, arginfo, arg, size_slot) < 0) {
+            return -1;
+        }
+    }
+
+    if (arginfo->known_params != NULL) {
+        Py_ssize_t idx = find_known_param(arginfo, spec, arg);
+        if (idx == -2) {
+            return -1;
+        }
+        if (idx >= 0) {
+            COUNTER_ADD64(counters->slots[arginfo->param_slots + idx], 1);
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Find the argument for a keyword.  Returns its index, -1 if we are not
+ * tracking it, or -2 on error.
+ */
+static Py_ssize_t
+resolve_kwname(StatsWrapperObject *self, PyObject *kwname)
+{
+    if (self->spec == NULL) {
+        return -1;  /* cleared */
+    }
+    argspec *curr_arginfo = self->spec->args + self->npos_only;
+    // Fast identity check, should always work out if the user told us all
+    // possible kwargs.
+    while (curr_arginfo->kwname != NULL) {
+        if (curr_arginfo->kwname == kwname) {
+            return curr_arginfo - self->spec->args;
+        }
+        curr_arginfo++;
+    }
+    /* The fast path didn't work out (UNLIKELY may make sense here) */
+    curr_arginfo = self->spec->args + self->npos_only;
+    while (curr_arginfo->kwname != NULL) {
+        int eq = PyObject_RichCompareBool(curr_arginfo->kwname, kwname, Py_EQ);
+        if (eq < 0) {
+            /* Should never happen, so error out right here */
+            return -2;
+        }
+        if (eq) {
+            return curr_arginfo - self->spec->args;
+        }
+        curr_arginfo++;
+    }
+    return -1;
+}
+
+
+static inline kwnames_resolution *
+lookup_kwnames(StatsWrapperObject *self, PyObject *kwnames)
+{
+    for (int i = 0; i < KWNAMES_CACHE_SIZE; i++) {
+#ifdef Py_GIL_DISABLED
+        kwnames_resolution *entry = _Py_atomic_load_ptr_acquire(
+                &self->kwnames_cache[i]);
+#else
+        kwnames_resolution *entry = self->kwnames_cache[i];
+#endif
+        if (entry != NULL && entry->kwnames == kwnames) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Resolve all names of `kwnames` and try to cache the result.  Returns NULL
+ * (possibly without an error set) if the result could not be cached.
+ */
+static kwnames_resolution *
+resolve_kwnames(StatsWrapperObject *self, PyObject *kwnames)
+{
+    /*
+     * A kwnames tuple only referenced by the caller was created for this
+     * call (e.g. `func(**kwargs)`), caching it would only thrash the cache.
+     */
+    if (Py_REFCNT(kwnames) <= 1) {
+        return NULL;
+    }
+    /* Once the cache is full, don't bother */
+#ifdef Py_GIL_DISABLED
+    if (_Py_atomic_load_ptr_relaxed(
+            &self->kwnames_cache[KWNAMES_CACHE_SIZE - 1]) != NULL) {
+#else
+    if (self->kwnames_cache[KWNAMES_CACHE_SIZE - 1] != NULL) {
+#endif
+        return NULL;
+    }
+    Py_ssize_t nkwargs = PyTuple_GET_SIZE(kwnames);
+    kwnames_resolution *entry = PyMem_Malloc(
+            sizeof(kwnames_resolution) + nkwargs * sizeof(Py_ssize_t));
+    if (entry == NULL) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < nkwargs; i++) {
+        entry->indices[i] = resolve_kwname(self, PyTuple_GET_ITEM(kwnames, i));
+        if (entry->indices[i] == -2) {
+            PyMem_Free(entry);
+            return NULL;
+        }
+    }
+    Py_INCREF(kwnames);
+    entry->kwnames = kwnames;
+
+    for (int i = 0; i < KWNAMES_CACHE_SIZE; i++) {
+#ifdef Py_GIL_DISABLED
+        void *expected = NULL;
+        if (_Py_atomic_compare_exchange_ptr(
+                &self->kwnames_cache[i], &expected, entry)) {
+            return entry;
+        }
+#else
+        if (self->kwnames_cache[i] == NULL) {
+            self->kwnames_cache[i] = entry;
+            return entry;
+        }
+#endif
+    }
+    /* The cache is full, the caller has to resolve one by one. */
+    Py_DECREF(kwnames);
+    PyMem_Free(entry);
+    return NULL;
+}
+
+
+/*
+ * Adapt the sampling interval so that no more than `max_sample_rate` calls
+ * are timed per second.  The interval grows as soon as the budget for the
+ * current (one second) window is exceeded and is halved again if the rate
+ * falls well below it.
+ */
+static void
+adapt_sample_interval(StatsWrapperObject *self, statscounters *counters,
+        int64_t now)
+{
+    Py_ssize_t max_rate = self->max_sample_rate;
+    Py_ssize_t interval = COUNTER_LOAD(counters->sample_interval);
+    Py_ssize_t window_samples = COUNTER_LOAD(counters->window_samples) + 1;
+    int64_t window = now - COUNTER_LOAD64(counters->window_start);
+    if (window_samples > max_rate) {
+        /* Scale by how far over budget we are (but at least double) */
+        double factor = 2.0;
+        if (window > 0) {
+            double rate = window_samples * 1e9 / window;
+            if (rate / max_rate > factor) {
+                factor = rate / max_rate;
+            }
+        }
+        if (interval * factor < (double)(PY_SSIZE_T_MAX / 2)) {
+            interval = (Py_ssize_t)(interval * factor);
+        }
+    }
+    else if (window < 1000000000) {
+        COUNTER_STORE(counters->window_samples, window_samples);
+        return;
+    }
+    else if (window_samples * 4 < max_rate && interval > 1) {
+        interval /= 2;
+    }
+    COUNTER_STORE(counters->sample_interval, interval);
+    COUNTER_STORE(counters->sample_countdown, interval);
+    COUNTER_STORE(counters->window_samples, 0);
+    COUNTER_STORE64(counters->window_start, now);
+}
+
+
+/*
+ * Thread-local stack of the wrapped calls in progress (from both the
+ * vectorcall and the sys.monitoring paths).  Children of a sampled call are
+ * always timed, so that its exclusive time can be computed.  Calls nested
+ * deeper than CALL_STACK_MAX are not on the stack and only timed inclusively.
+ */
+#define CALL_STACK_MAX 256
+
+typedef struct {
+    StatsWrapperObject *wrapper;
+    uint64_t wrapper_id;  // the wrapper may be gone once it is a caller
+    int64_t start_time;  // -1 if the call is not timed
+    int64_t cpu_start;  // -1 if the CPU time is not measured
+    int64_t child_time;  // time spent in timed nested calls
+    Py_ssize_t interval;  // sampling interval, 0 if not sampled
+} call_frame;
+
+static THREAD_LOCAL call_frame call_stack[CALL_STACK_MAX];
+static THREAD_LOCAL Py_ssize_t call_depth = 0;
+
+
+/*
+ * Push a frame for a call to `self`, `interval` is 0 if the call is not
+ * sampled.  Returns the depth of the frame (to pass to `pop_frame`).
+ */
+static inline Py_ssize_t
+push_frame(StatsWrapperObject *self, Py_ssize_t interval)
+{
+    Py_ssize_t depth = call_depth++;
+    if (depth >= CALL_STACK_MAX) {
+        return depth;
+    }
+    call_frame *frame = &call_stack[depth];
+    frame->wrapper = self;
+    frame->wrapper_id = self->wrapper_id;
+    frame->interval = interval;
+    frame->child_time = 0;
+    frame->cpu_start = -1;
+    if (interval > 0 && self->cpu_slots >= 0) {
+        frame->cpu_start = thread_cpu_ns();
+    }
+    if (interval > 0 || (depth > 0 && call_stack[depth - 1].interval > 0)) {
+        frame->start_time = monotonic_ns();
+    }
+    else {
+        frame->start_time = -1;
+    }
+    return depth;
+}
+
+
+/* Whether `self` is already active below `depth` (a recursive call) */
+static inline int
+is_recursive(StatsWrapperObject *self, Py_ssize_t depth)
+{
+    for (Py_ssize_t i = depth - 1; i >= 0; i--) {
+        if (call_stack[i].wrapper == self) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Index of the caller of the frame at `depth` in the `callers` table of
+ * `self` (inserting it if there is space), CALLER_TABLE_SIZE for other
+ * callers and -1 if there is no wrapped caller.
+ */
+static inline Py_ssize_t
+caller_index(StatsWrapperObject *self, Py_ssize_t depth)
+{
+    if (depth == 0) {
+        return -1;
+    }
+    if (depth > CALL_STACK_MAX) {
+        return CALLER_TABLE_SIZE;  /* the caller is not on the stack */
+    }
+    uint64_t id = call_stack[depth - 1].wrapper_id;
+    size_t i = (size_t)id & (CALLER_TABLE_SIZE - 1);
+    for (int probe = 0; probe < CALLER_TABLE_SIZE;
+            probe++, i = (i + 1) & (CALLER_TABLE_SIZE - 1)) {
+#ifdef Py_GIL_DISABLED
+        uint64_t entry = _Py_atomic_load_uint64_relaxed(&self->callers[i]);
+        if (entry == 0 && COUNTER_LOAD(self->n_callers) < CALLER_TABLE_MAX) {
+            /* Try to insert, if another thread won, check what it inserted */
+            if (_Py_atomic_compare_exchange_uint64(&self->callers[i], &entry, id)) {
+                COUNTER_ADD(self->n_callers, 1);
+                entry = id;
+            }
+        }
+#else
+        uint64_t entry = self->callers[i];
+        if (entry == 0 && self->n_callers < CALLER_TABLE_MAX) {
+            self->callers[i] = id;
+            self->n_callers++;
+            entry = id;
+        }
+#endif
+        if (entry == id) {
+            return i;
+        }
+        if (entry == 0) {
+            break;  /* the table is full */
+        }
+    }
+    return CALLER_TABLE_SIZE;
+}
+
+
+static inline char *
+cache_line_align(void *alloc)
+{
+    return (char *)(((uintptr_t)alloc + CACHE_LINE - 1)
+                    & ~(uintptr_t)(CACHE_LINE - 1));
+}
+
+
+/*
+ * The caller counter block for the current thread, allocating the blocks of
+ * all shards on first use.  Returns NULL (without an exception set) if that
+ * fails, the call is then not counted by caller.
+ */
+static callercounters *
+get_caller_counters(StatsWrapperObject *self)
+{
+#ifdef Py_GIL_DISABLED
+    void *alloc = _Py_atomic_load_ptr_acquire(&self->caller_counters_alloc);
+#else
+    void *alloc = self->caller_counters_alloc;
+#endif
+    if (alloc == NULL) {
+        alloc = PyMem_Calloc(1, COUNTER_SHARDS * CALLER_COUNTERS_STRIDE + CACHE_LINE);
+        if (alloc == NULL) {
+            return NULL;
+        }
+#ifdef Py_GIL_DISABLED
+        void *expected = NULL;
+        if (!_Py_atomic_compare_exchange_ptr(
+                &self->caller_counters_alloc, &expected, alloc)) {
+            PyMem_Free(alloc);  /* another thread was faster */
+            alloc = expected;
+        }
+#else
+        self->caller_counters_alloc = alloc;
+#endif
+    }
+    Py_ssize_t shard = 0;
+#ifdef Py_GIL_DISABLED
+    shard = thread_shard >= 0 ? thread_shard : 0;
+#endif
+    return (callercounters *)(cache_line_align(alloc)
+                              + shard * CALLER_COUNTERS_STRIDE);
+}
+
+
+/*
+ * Allocate the histograms of all shards, in the arena if the counters are
+ * there.  Done under the registry lock (which also keeps the arena from
+ * being set up meanwhile), but nothing in here runs Python code.
+ */
+static char *
+allocate_histograms(StatsWrapperObject *self)
+{
+    REGISTRY_LOCK();
+    char *blocks = self->histograms;
+    if (blocks == NULL) {
+        blocks = arena_allocate_histograms(self);
+        if (blocks == NULL) {
+            void *alloc = PyMem_Calloc(1, COUNTER_SHARDS * HIST_STRIDE + CACHE_LINE);
+            if (alloc != NULL) {
+                self->histograms_alloc = alloc;
+                blocks = cache_line_align(alloc);
+            }
+        }
+        if (blocks != NULL) {
+#ifdef Py_GIL_DISABLED
+            _Py_atomic_store_ptr_release(&self->histograms, blocks);
+#else
+            self->histograms = blocks;
+#endif
+        }
+    }
+    REGISTRY_UNLOCK();
+    return blocks;
+}
+
+
+/*
+ * The histogram for the current thread, allocating those of all shards on
+ * the first timed call.  Returns NULL (without an exception set) if that
+ * fails, the call is then missing from the histogram.
+ */
+static inline Py_ssize_t *
+get_histogram(StatsWrapperObject *self)
+{
+#ifdef Py_GIL_DISABLED
+    char *blocks = _Py_atomic_load_ptr_acquire(&self->histograms);
+#else
+    char *blocks = self->histograms;
+#endif
+    if (blocks == NULL) {
+        blocks = allocate_histograms(self);
+        if (blocks == NULL) {
+            return NULL;
+        }
+    }
+    Py_ssize_t shard = 0;
+#ifdef Py_GIL_DISABLED
+    shard = thread_shard >= 0 ? thread_shard : 0;
+#endif
+    return (Py_ssize_t *)(blocks + shard * HIST_STRIDE);
+}
+
+
+/* Add to the counters of the caller at `caller` (see `caller_index()`) */
+static inline void
+record_caller(StatsWrapperObject *self, Py_ssize_t caller, int64_t calls,
+        int64_t time, int64_t self_time)
+{
+    callercounters *callers = get_caller_counters(self);
+    if (callers == NULL) {
+        return;
+    }
+    if (calls != 0) {
+        COUNTER_ADD64(callers->calls[caller], calls);
+    }
+    if (time != 0 || self_time != 0) {
+        COUNTER_ADD64(callers->time[caller], time);
+        COUNTER_ADD64(callers->self_time[caller], self_time);
+    }
+}
+
+
+static inline void record_timing(
+        StatsWrapperObject *self, statscounters *counters, int64_t start_time,
+        int64_t elapsed, Py_ssize_t interval, Py_ssize_t size_slot);
+static inline void record_cpu_time(
+        StatsWrapperObject *self, statscounters *counters, int64_t cpu_time,
+        Py_ssize_t interval);
+
+
+/*
+ * Pop the frame at `depth` (and any above it) and record its timing.
+ */
+static inline void
+pop_frame(StatsWrapperObject *self, statscounters *counters, Py_ssize_t depth,
+        Py_ssize_t size_slot)
+{
+    call_depth = depth;
+    Py_ssize_t caller = caller_index(self, depth);
+    int64_t time = 0;
+    int64_t self_time = 0;
+    call_frame *frame = depth < CALL_STACK_MAX ? &call_stack[depth] : NULL;
+    if (frame != NULL && frame->start_time >= 0) {
+        int64_t elapsed = monotonic_ns() - frame->start_time;
+        if (depth > 0) {
+            call_stack[depth - 1].child_time += elapsed;
+        }
+        /* With an interval of 0, the call is only timed for the parent */
+        if (frame->interval > 0) {
+            record_timing(self, counters, frame->start_time, elapsed,
+                          frame->interval, size_slot);
+            if (frame->cpu_start >= 0) {
+                record_cpu_time(self, counters,
+                                thread_cpu_ns() - frame->cpu_start,
+                                frame->interval);
+            }
+            time = elapsed * frame->interval;
+            self_time = (elapsed - frame->child_time) * frame->interval;
+            COUNTER_ADD64(counters->est_self_time, self_time);
+            if (!is_recursive(self, depth)) {
+                COUNTER_ADD64(counters->est_outer_time, time);
+            }
+        }
+    }
+    if (caller >= 0) {
+        record_caller(self, caller, 1, time, self_time);
+    }
+}
+
+
+/*
+ * Record a timed call which took `elapsed` ns.  `interval` is the sampling
+ * interval it was sampled at.
+ */
+static inline void
+record_timing(StatsWrapperObject *self, statscounters *counters,
+        int64_t start_time, int64_t elapsed, Py_ssize_t interval,
+        Py_ssize_t size_slot)
+{
+    COUNTER_ADD(counters->timed_calls, 1);
+    COUNTER_ADD64(counters->total_time, elapsed);
+    COUNTER_ADD64(counters->est_total_time, elapsed * interval);
+    COUNTER_ADD64(counters->est_wall_time, elapsed * interval);
+    counter_min64(&counters->min_time, elapsed);
+    counter_max64(&counters->max_time, elapsed);
+    Py_ssize_t *histogram = get_histogram(self);
+    if (histogram != NULL) {
+        COUNTER_ADD(histogram[histogram_bucket(elapsed)], 1);
+    }
+    if (size_slot >= 0) {
+        COUNTER_ADD64(counters->slots[size_slot + ARRAY_TIMED_OFFSET], 1);
+        COUNTER_ADD64(counters->slots[size_slot + ARRAY_TIME_OFFSET], elapsed);
+    }
+    if (self->sketch != NULL) {
+        /* Running out of memory just means the sample is lost. */
+        SKETCH_LOCK(self->sketch);
+        (void)sketch_add(self->sketch, elapsed * 1e-9);
+        SKETCH_UNLOCK(self->sketch);
+    }
+    if (self->max_sample_rate > 0) {
+        adapt_sample_interval(self, counters, start_time);
+    }
+}
+
+
+static inline void
+record_cpu_time(StatsWrapperObject *self, statscounters *counters,
+        int64_t cpu_time, Py_ssize_t interval)
+{
+    int64_t *slots = &counters->slots[self->cpu_slots];
+    COUNTER_ADD64(slots[histogram_bucket(cpu_time)], 1);
+    COUNTER_ADD64(slots[CPU_TIMED_OFFSET], 1);
+    COUNTER_ADD64(slots[CPU_TIME_OFFSET], cpu_time);
+    COUNTER_ADD64(slots[CPU_EST_TIME_OFFSET], cpu_time * interval);
+}
+
+
+/* Call the wrapped callable (via its cached vectorcall if possible) */
+static inline PyObject *
+call_wrapped(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    if (self->wrapped_vectorcall != NULL) {
+        return self->wrapped_vectorcall(self->wrapped, args, len_args, kwnames);
+    }
+    return PyObject_Vectorcall(self->wrapped, args, len_args, kwnames);
+}
+
+
+/*
+ * Calling a generator, coroutine or async generator function only creates
+ * the object, the work happens while it is resumed.  For those, the wrapper
+ * returns a proxy that times every resumption (`active` time) and records
+ * the call once the object finishes (or is dropped), along with the `wall`
+ * time from its first resumption on.  Async generators hand out awaitables,
+ * which are proxied in turn and accumulate into their async generator.
+ */
+enum {
+    GEN_NONE = 0,
+    GEN_GENERATOR,
+    GEN_COROUTINE,
+    GEN_ASYNC_GENERATOR,
+};
+
+typedef struct TimedGenObject {
+    PyObject_HEAD
+    StatsWrapperObject *wrapper;
+    PyObject *gen;  // the generator, coroutine, async generator or awaitable
+    struct TimedGenObject *parent;  // the async generator of an awaitable
+    int closes_parent;  // awaitable from `aclose()`
+    int finished;
+    Py_ssize_t interval;  // sampling interval, 0 if not timed
+    Py_ssize_t caller;  // see `caller_index()`
+    int64_t first_start;  // -1 if not yet resumed
+    int64_t active_time;
+    int64_t self_time;
+    int64_t cpu_time;
+} TimedGenObject;
+
+static PyTypeObject TimedGenerator_Type;
+static PyTypeObject TimedCoroutine_Type;
+static PyTypeObject TimedAsyncGenerator_Type;
+
+static PyObject *str_send = NULL;
+static PyObject *str_throw = NULL;
+static PyObject *str_close = NULL;
+static PyObject *str_asend = NULL;
+static PyObject *str_athrow = NULL;
+static PyObject *str_aclose = NULL;
+
+
+static PyObject *
+timedgen_new(PyTypeObject *type, StatsWrapperObject *wrapper, PyObject *gen,
+        TimedGenObject *parent, Py_ssize_t interval, Py_ssize_t caller)
+{
+    TimedGenObject *self = PyObject_GC_New(TimedGenObject, type);
+    if (self == NULL) {
+        Py_DECREF(gen);
+        return NULL;
+    }
+    Py_INCREF(wrapper);
+    self->wrapper = wrapper;
+    self->gen = gen;
+    Py_XINCREF(parent);
+    self->parent = parent;
+    self->closes_parent = 0;
+    self->finished = 0;
+    self->interval = interval;
+    self->caller = caller;
+    self->first_start = -1;
+    self->active_time = 0;
+    self->self_time = 0;
+    self->cpu_time = 0;
+    PyObject_GC_Track(self);
+    return (PyObject *)self;
+}
+
+
+/* Record the call once the generator is done (or dropped) */
+static void
+timedgen_finish(TimedGenObject *self, int error)
+{
+    if (self->finished) {
+        return;
+    }
+    self->finished = 1;
+    StatsWrapperObject *wrapper = self->wrapper;
+    statscounters *counters = get_counters(wrapper);
+    if (error) {
+        COUNTER_ADD(counters->error_results, 1);
+    }
+    Py_ssize_t interval = self->interval;
+    if (interval == 0 || self->first_start < 0) {
+        return;
+    }
+    int64_t wall = monotonic_ns() - self->first_start;
+    record_timing(wrapper, counters, self->first_start, self->active_time,
+                  interval, -1);
+    if (wrapper->cpu_slots >= 0) {
+        record_cpu_time(wrapper, counters, self->cpu_time, interval);
+    }
+    COUNTER_ADD64(counters->est_wall_time,
+                  (wall - self->active_time) * interval);
+    COUNTER_ADD64(counters->est_self_time, self->self_time * interval);
+    COUNTER_ADD64(counters->est_outer_time, self->active_time * interval);
+    if (self->caller >= 0) {
+        record_caller(wrapper, self->caller, 0, self->active_time * interval,
+                      self->self_time * interval);
+    }
+}
+
+
+enum { GEN_OP_NEXT, GEN_OP_SEND, GEN_OP_THROW, GEN_OP_CLOSE };
+
+/*
+ * Resume the proxied object.  While it runs, it is on the call stack like
+ * any other wrapped call (so that nested wrapped calls see it as caller).
+ */
+static PyObject *
+timedgen_resume(TimedGenObject *self, int op, PyObject *arg)
+{
+    TimedGenObject *root = self->parent != NULL ? self->parent : self;
+    Py_ssize_t depth = push_frame(root->wrapper,
+                                  root->finished ? 0 : root->interval);
+
+    PyObject *res;
+    switch (op) {
+    case GEN_OP_NEXT:
+        if (Py_TYPE(self->gen)->tp_iternext != NULL) {
+            res = Py_TYPE(self->gen)->tp_iternext(self->gen);
+        }
+        else {
+            res = PyObject_CallMethodOneArg(self->gen, str_send, Py_None);
+        }
+        break;
+    case GEN_OP_SEND:
+        res = PyObject_CallMethodOneArg(self->gen, str_send, arg);
+        break;
+    case GEN_OP_THROW: {
+        PyObject *throw = PyObject_GetAttr(self->gen, str_throw);
+        res = throw != NULL ? PyObject_Call(throw, arg, NULL) : NULL;
+        Py_XDECREF(throw);
+        break;
+    }
+    default:
+        res = PyObject_CallMethodNoArgs(self->gen, str_close);
+        break;
+    }
+
+    call_depth = depth;
+    if (depth < CALL_STACK_MAX && call_stack[depth].start_time >= 0) {
+        call_frame *frame = &call_stack[depth];
+        int64_t elapsed = monotonic_ns() - frame->start_time;
+        if (depth > 0) {
+            call_stack[depth - 1].child_time += elapsed;
+        }
+        if (frame->interval > 0) {
+            if (root->first_start < 0) {
+                root->first_start = frame->start_time;
+            }
+            root->active_time += elapsed;
+            root->self_time += elapsed - frame->child_time;
+            if (frame->cpu_start >= 0) {
+                root->cpu_time += thread_cpu_ns() - frame->cpu_start;
+            }
+        }
+    }
+
+    if (res != NULL) {
+        if (op == GEN_OP_CLOSE && self->parent == NULL) {
+            timedgen_finish(root, 0);
+        }
+        return res;
+    }
+    if (!PyErr_Occurred()) {
+        timedgen_finish(root, 0);  /* exhausted (`tp_iternext`) */
+    }
+    else if (self->parent != NULL) {
+        /* An awaitable completing just means the async generator yielded */
+        if (PyErr_ExceptionMatches(PyExc_StopAsyncIteration) ||
+                (self->closes_parent &&
+                 PyErr_ExceptionMatches(PyExc_StopIteration))) {
+            timedgen_finish(root, 0);
+        }
+        else if (!PyErr_ExceptionMatches(PyExc_StopIteration)) {
+            timedgen_finish(root, 1);
+        }
+    }
+    else if (PyErr_ExceptionMatches(PyExc_StopIteration) ||
+             PyErr_ExceptionMatches(PyExc_GeneratorExit)) {
+        timedgen_finish(root, 0);
+    }
+    else {
+        timedgen_finish(root, 1);
+    }
+    return NULL;
+}
+
+
+static PyObject *
+timedgen_iternext(TimedGenObject *self)
+{
+    return timedgen_resume(self, GEN_OP_NEXT, NULL);
+}
+
+
+static PyObject *
+timedgen_send(TimedGenObject *self, PyObject *value)
+{
+    return timedgen_resume(self, GEN_OP_SEND, value);
+}
+
+
+static PyObject *
+timedgen_throw(TimedGenObject *self, PyObject *args)
+{
+    return timedgen_resume(self, GEN_OP_THROW, args);
+}
+
+
+static PyObject *
+timedgen_close(TimedGenObject *self, PyObject *unused)
+{
+    return timedgen_resume(self, GEN_OP_CLOSE, NULL);
+}
+
+
+static PyObject *
+timedgen_self(PyObject *self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+
+/* Wrap the awaitable returned by a method of an async generator */
+static PyObject *
+timedgen_awaitable(TimedGenObject *self, PyObject *awaitable, int closes)
+{
+    if (awaitable == NULL) {
+        return NULL;
+    }
+    PyObject *res = timedgen_new(&TimedCoroutine_Type, self->wrapper,
+            awaitable, self, self->interval, self->caller);
+    if (res != NULL) {
+        ((TimedGenObject *)res)->closes_parent = closes;
+    }
+    return res;
+}
+
+
+static PyObject *
+timedgen_anext(TimedGenObject *self)
+{
+    return timedgen_awaitable(self,
+            Py_TYPE(self->gen)->tp_as_async->am_anext(self->gen), 0);
+}
+
+
+static PyObject *
+timedgen_asend(TimedGenObject *self, PyObject *value)
+{
+    return timedgen_awaitable(self,
+            PyObject_CallMethodOneArg(self->gen, str_asend, value), 0);
+}
+
+
+static PyObject *
+timedgen_athrow(TimedGenObject *self, PyObject *args)
+{
+    PyObject *athrow = PyObject_GetAttr(self->gen, str_athrow);
+    if (athrow == NULL) {
+        return NULL;
+    }
+    PyObject *awaitable = PyObject_Call(athrow, args, NULL);
+    Py_DECREF(athrow);
+    return timedgen_awaitable(self, awaitable, 0);
+}
+
+
+static PyObject *
+timedgen_aclose(TimedGenObject *self, PyObject *unused)
+{
+    return timedgen_awaitable(self,
+            PyObject_CallMethodNoArgs(self->gen, str_aclose), 1);
+}
+
+
+/* Other attributes (e.g. `gi_frame` or `__name__`) come from the object */
+static PyObject *
+timedgen_getattro(TimedGenObject *self, PyObject *name)
+{
+    PyObject *res = PyObject_GenericGetAttr((PyObject *)self, name);
+    if (res == NULL && PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        PyErr_Clear();
+        res = PyObject_GetAttr(self->gen, name);
+    }
+    return res;
+}
+
+
+static int
+timedgen_traverse(TimedGenObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->wrapper);
+    Py_VISIT(self->gen);
+    Py_VISIT(self->parent);
+    return 0;
+}
+
+
+static int
+timedgen_clear(TimedGenObject *self)
+{
+    Py_CLEAR(self->gen);
+    Py_CLEAR(self->parent);
+    return 0;
+}
+
+
+static void
+timedgen_dealloc(TimedGenObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    if (self->parent == NULL) {
+        /* Dropped before finishing, e.g. `break` out of a loop. */
+        timedgen_finish(self, 0);
+    }
+    timedgen_clear(self);
+    Py_CLEAR(self->wrapper);
+    PyObject_GC_Del(self);
+}
+
+
+static PyMethodDef timedgen_methods[] = {
+    {"send", (PyCFunction)timedgen_send, METH_O, NULL},
+    {"throw", (PyCFunction)timedgen_throw, METH_VARARGS, NULL},
+    {"close", (PyCFunction)timedgen_close, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyMethodDef timedasyncgen_methods[] = {
+    {"asend", (PyCFunction)timedgen_asend, METH_O, NULL},
+    {"athrow", (PyCFunction)timedgen_athrow, METH_VARARGS, NULL},
+    {"aclose", (PyCFunction)timedgen_aclose, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyAsyncMethods timedcoroutine_as_async = {
+    .am_await = (unaryfunc)timedgen_self,
+};
+
+
+static PyAsyncMethods timedasyncgen_as_async = {
+    .am_aiter = (unaryfunc)timedgen_self,
+    .am_anext = (unaryfunc)timedgen_anext,
+};
+
+
+static PyTypeObject TimedGenerator_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "telemetric.statswrapper._stats_wrapper._TimedGenerator",
+    .tp_basicsize = sizeof(TimedGenObject),
+    .tp_dealloc = (destructor)timedgen_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)timedgen_traverse,
+    .tp_clear = (inquiry)timedgen_clear,
+    .tp_getattro = (getattrofunc)timedgen_getattro,
+    .tp_iter = (getiterfunc)timedgen_self,
+    .tp_iternext = (iternextfunc)timedgen_iternext,
+    .tp_methods = timedgen_methods,
+};
+
+
+/* Also used for the awaitables of async generators */
+static PyTypeObject TimedCoroutine_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "telemetric.statswrapper._stats_wrapper._TimedCoroutine",
+    .tp_basicsize = sizeof(TimedGenObject),
+    .tp_dealloc = (destructor)timedgen_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)timedgen_traverse,
+    .tp_clear = (inquiry)timedgen_clear,
+    .tp_getattro = (getattrofunc)timedgen_getattro,
+    .tp_as_async = &timedcoroutine_as_async,
+    .tp_iter = (getiterfunc)timedgen_self,
+    .tp_iternext = (iternextfunc)timedgen_iternext,
+    .tp_methods = timedgen_methods,
+};
+
+
+static PyTypeObject TimedAsyncGenerator_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "telemetric.statswrapper._stats_wrapper._TimedAsyncGenerator",
+    .tp_basicsize = sizeof(TimedGenObject),
+    .tp_dealloc = (destructor)timedgen_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)timedgen_traverse,
+    .tp_clear = (inquiry)timedgen_clear,
+    .tp_getattro = (getattrofunc)timedgen_getattro,
+    .tp_as_async = &timedasyncgen_as_async,
+    .tp_methods = timedasyncgen_methods,
+};
+
+
+/*
+ * Call a generator (etc.) function, returns the proxy of the result.  The
+ * call is recorded when the proxy finishes.
+ */
+static PyObject *
+call_generator_function(StatsWrapperObject *self, statscounters *counters,
+        Py_ssize_t interval, PyObject *const *args, Py_ssize_t len_args,
+        PyObject *kwnames, int timed)
+{
+    Py_ssize_t caller = timed ? caller_index(self, call_depth) : -1;
+    if (caller >= 0) {
+        record_caller(self, caller, 1, 0, 0);
+    }
+    PyObject *gen = call_wrapped(self, args, len_args, kwnames);
+    if (gen == NULL) {
+        COUNTER_ADD(counters->error_results, 1);
+        return NULL;
+    }
+    PyTypeObject *type = (
+        self->gen_kind == GEN_GENERATOR ? &TimedGenerator_Type :
+        self->gen_kind == GEN_COROUTINE ? &TimedCoroutine_Type :
+        &TimedAsyncGenerator_Type);
+    return timedgen_new(type, self, gen, NULL, interval, caller);
+}
+
+
+/*
+ * Used while stats are disabled: only forwards to the wrapped callable.
+ */
+static PyObject *
+statswrapper_passthrough(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    return call_wrapped(self, args, len_args, kwnames);
+}
+
+
+/* Used once `statswrapper_clear()` dropped the wrapped callable */
+static PyObject *
+statswrapper_cleared(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    PyErr_SetString(PyExc_ReferenceError, "The wrapped callable was cleared.");
+    return NULL;
+}
+
+
+/*
+ * The call implementation, specialized by `select_vectorcall()` via the
+ * constant flags:
+ * - `simple`: no argument tracks values or arrays, so a positional argument
+ *   only increments its use count (slot `i`), or its use count and type if
+ *   type stats are enabled (always for all arguments).
+ * - `timed`: timing may be sampled (otherwise `_set_sampling(0)` was used).
+ *   Untimed calls are not put on the call stack at all, so they are not in
+ *   the call graph and count as self time of their caller.
+ */
+static inline PyObject *
+vectorcall_impl(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames,
+        const int simple, const int timed)
+{
+    int invalid_args = 0;
+    Py_ssize_t nargs = PyVectorcall_NARGS(len_args);
+    statscounters *counters = get_counters(self);
+    /* Size bucket of the first argument with array stats (if any) */
+    Py_ssize_t size_slot = -1;
+
+    /* Make sure we don't crash on bad args (or incorrect setup) */
+    Py_ssize_t nargs_valid = nargs;
+    if (nargs > self->npos) {
+        invalid_args = 1;
+        nargs_valid = self->npos;
+    }
+
+    if (simple && nargs_valid > 0 && self->args[0].types != NULL) {
+        for (Py_ssize_t i = 0; i < nargs_valid; i++) {
+            arginfo *info = &self->args[i];
+            COUNTER_ADD64(counters->slots[info->count_slot], 1);
+            record_type(counters, info, Py_TYPE(args[i]));
+        }
+    }
+    else if (simple) {
+        int64_t *slots = counters->slots;
+        switch (nargs_valid) {
+        default:
+            for (Py_ssize_t i = 4; i < nargs_valid; i++) {
+                COUNTER_ADD64(slots[i], 1);
+            }
+            /* fall through */
+        case 4: COUNTER_ADD64(slots[3], 1);  /* fall through */
+        case 3: COUNTER_ADD64(slots[2], 1);  /* fall through */
+        case 2: COUNTER_ADD64(slots[1], 1);  /* fall through */
+        case 1: COUNTER_ADD64(slots[0], 1);  /* fall through */
+        case 0: break;
+        }
+    }
+    else {
+        for (Py_ssize_t i = 0; i < nargs_valid; i++) {
+            if (handle_arg_stats(counters, &self->args[i], &self->spec->args[i],
+                    args[i], &size_slot) < 0) {
+                return NULL;
+            }
+        }
+    }
+
+    Py_ssize_t nkwargs = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    if (nkwargs > 0) {
+        kwnames_resolution *resolution = lookup_kwnames(self, kwnames);
+        if (resolution == NULL) {
+            resolution = resolve_kwnames(self, kwnames);
+        }
+        if (resolution != NULL) {
+            for (Py_ssize_t i = 0; i < nkwargs; i++) {
+                Py_ssize_t idx = resolution->indices[i];
+                if (idx < 0) {
+                    invalid_args = 1;
+                }
+                else if (handle_arg_stats(counters, &self->args[idx],
+                        &self->spec->args[idx], args[nargs + i], &size_slot) < 0) {
+                    return NULL;
+                }
+            }
+        }
+        else {
+            /* Could not cache the resolution, resolve one by one. */
+            if (PyErr_Occurred()) {
+                return NULL;
+            }
+            for (Py_ssize_t i = 0; i < nkwargs; i++) {
+                Py_ssize_t idx = resolve_kwname(
+                        self, PyTuple_GET_ITEM(kwnames, i));
+                if (idx == -2) {
+                    return NULL;
+                }
+                if (idx < 0) {
+                    invalid_args = 1;
+                }
+                else if (handle_arg_stats(counters, &self->args[idx],
+                        &self->spec->args[idx], args[nargs + i], &size_slot) < 0) {
+                    return NULL;
+                }
+            }
+        }
+    }
+
+    COUNTER_ADD(counters->total_calls, 1);
+    if (invalid_args) {
+        COUNTER_ADD(counters->invalid_args, 1);
+    }
+
+    Py_ssize_t interval = 0;  /* not sampled */
+    if (timed) {
+        Py_ssize_t countdown = COUNTER_LOAD(counters->sample_countdown);
+        if (countdown > 1) {
+            COUNTER_STORE(counters->sample_countdown, countdown - 1);
+        }
+        else {
+            interval = COUNTER_LOAD(counters->sample_interval);
+            COUNTER_STORE(counters->sample_countdown, interval);
+        }
+    }
+
+    if (!simple && self->gen_kind != GEN_NONE) {
+        return call_generator_function(
+                self, counters, interval, args, len_args, kwnames, timed);
+    }
+
+    if (!timed) {
+        PyObject *res = call_wrapped(self, args, len_args, kwnames);
+        if (res == NULL) {
+            COUNTER_ADD(counters->error_results, 1);
+        }
+        return res;
+    }
+
+    Py_ssize_t depth = push_frame(self, interval);
+    if (depth >= CALL_STACK_MAX && interval > 0) {
+        /* Too deep for the stack, only time the call itself */
+        int64_t cpu_start = self->cpu_slots >= 0 ? thread_cpu_ns() : -1;
+        int64_t start_time = monotonic_ns();
+        PyObject *res = call_wrapped(self, args, len_args, kwnames);
+        int64_t elapsed = monotonic_ns() - start_time;
+        record_timing(self, counters, start_time, elapsed, interval, size_slot);
+        if (cpu_start >= 0) {
+            record_cpu_time(self, counters, thread_cpu_ns() - cpu_start,
+                            interval);
+        }
+        call_depth = depth;
+        record_caller(self, caller_index(self, depth), 1, elapsed * interval, 0);
+        if (res == NULL) {
+            COUNTER_ADD(counters->error_results, 1);
+        }
+        return res;
+    }
+
+    /* Call the wrapped function */
+    PyObject *res = call_wrapped(self, args, len_args, kwnames);
+
+    pop_frame(self, counters, depth, size_slot);
+
+    if (res == NULL) {
+        COUNTER_ADD(counters->error_results, 1);
+    }
+    return res;
+}
+
+
+static PyObject *
+statswrapper_vectorcall(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    return vectorcall_impl(self, args, len_args, kwnames, 0, 1);
+}
+
+
+static PyObject *
+statswrapper_vectorcall_untimed(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    return vectorcall_impl(self, args, len_args, kwnames, 0, 0);
+}
+
+
+static PyObject *
+statswrapper_vectorcall_simple(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    return vectorcall_impl(self, args, len_args, kwnames, 1, 1);
+}
+
+
+static PyObject *
+statswrapper_vectorcall_simple_untimed(StatsWrapperObject *self,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    return vectorcall_impl(self, args, len_args, kwnames, 1, 0);
+}
+
+
+/* Read and replace a counter (atomically on free-threaded builds) */
+static inline Py_ssize_t
+counter_take(Py_ssize_t *field, Py_ssize_t value)
+{
+#ifdef Py_GIL_DISABLED
+    return _Py_atomic_exchange_ssize(field, value);
+#else
+    Py_ssize_t old = *field;
+    *field = value;
+    return old;
+#endif
+}
+
+
+static inline int64_t
+counter_take64(int64_t *field, int64_t value)
+{
+#ifdef Py_GIL_DISABLED
+    return _Py_atomic_exchange_int64(field, value);
+#else
+    int64_t old = *field;
+    *field = value;
+    return old;
+#endif
+}
+
+
+/*
+ * Sum up the counter blocks of all shards (min/max are reduced).  Slots are
+ * summed when `slots` is passed (it must have room for all of them).
+ * If `reset` is set, all counters are zeroed while reading them, so that no
+ * concurrent update is lost (the sampling state is kept).
+ */
+static void
+collect_counters(StatsWrapperObject *self, statscounters *res, int64_t *slots,
+        int reset)
+{
+#define READ(field) (reset ? counter_take(&(field), 0) : COUNTER_LOAD(field))
+#define READ64(field, init) \
+        (reset ? counter_take64(&(field), (init)) : COUNTER_LOAD64(field))
+    Py_ssize_t nslots = (self->counters_stride - sizeof(statscounters))
+                        / sizeof(int64_t);
+    memset(res, 0, sizeof(statscounters));
+    res->min_time = INT64_MAX;
+    if (slots != NULL) {
+        memset(slots, 0, nslots * sizeof(int64_t));
+    }
+    for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+        statscounters *c = get_shard(self, shard);
+        res->total_calls += READ(c->total_calls);
+        res->invalid_args += READ(c->invalid_args);
+        res->error_results += READ(c->error_results);
+        res->timed_calls += READ(c->timed_calls);
+        res->total_time += READ64(c->total_time, 0);
+        res->est_total_time += READ64(c->est_total_time, 0);
+        res->est_self_time += READ64(c->est_self_time, 0);
+        res->est_outer_time += READ64(c->est_outer_time, 0);
+        res->est_wall_time += READ64(c->est_wall_time, 0);
+        int64_t min_time = READ64(c->min_time, INT64_MAX);
+        int64_t max_time = READ64(c->max_time, 0);
+        if (min_time < res->min_time) {
+            res->min_time = min_time;
+        }
+        if (max_time > res->max_time) {
+            res->max_time = max_time;
+        }
+        if (slots != NULL) {
+            for (Py_ssize_t i = 0; i < nslots; i++) {
+                slots[i] += READ64(c->slots[i], 0);
+            }
+        }
+    }
+    if (res->timed_calls == 0) {
+        res->min_time = 0;
+    }
+#undef READ
+#undef READ64
+}
+
+
+/* Like `collect_counters()` for the caller counters (zero if never used) */
+static void
+collect_caller_counters(StatsWrapperObject *self, callercounters *res,
+        int reset)
+{
+#define READ64(field) (reset ? counter_take64(&(field), 0) : COUNTER_LOAD64(field))
+    memset(res, 0, sizeof(callercounters));
+#ifdef Py_GIL_DISABLED
+    void *alloc = _Py_atomic_load_ptr_acquire(&self->caller_counters_alloc);
+#else
+    void *alloc = self->caller_counters_alloc;
+#endif
+    if (alloc == NULL) {
+        return;
+    }
+    for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+        callercounters *c = (callercounters *)(cache_line_align(alloc)
+                                               + shard * CALLER_COUNTERS_STRIDE);
+        for (Py_ssize_t i = 0; i < CALLER_TABLE_SIZE + 1; i++) {
+            res->calls[i] += READ64(c->calls[i]);
+            res->time[i] += READ64(c->time[i]);
+            res->self_time[i] += READ64(c->self_time[i]);
+        }
+    }
+#undef READ64
+}
+
+
+/* Like `collect_counters()` for the histograms (zero if never used) */
+static void
+collect_histogram(StatsWrapperObject *self, Py_ssize_t *res, int reset)
+{
+    memset(res, 0, HIST_BUCKETS * sizeof(Py_ssize_t));
+#ifdef Py_GIL_DISABLED
+    char *blocks = _Py_atomic_load_ptr_acquire(&self->histograms);
+#else
+    char *blocks = self->histograms;
+#endif
+    if (blocks == NULL) {
+        return;
+    }
+    for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+        Py_ssize_t *h = (Py_ssize_t *)(blocks + shard * HIST_STRIDE);
+        for (Py_ssize_t i = 0; i < HIST_BUCKETS; i++) {
+            res[i] += reset ? counter_take(&h[i], 0) : COUNTER_LOAD(h[i]);
+        }
+    }
+}
+
+
+static PyObject *
+counts_to_tuple(statscounters *counters)
+{
+    return Py_BuildValue("nnn",
+        counters->total_calls, counters->error_results, counters->invalid_args);
+}
+
+
+static PyObject *
+statswrapper__get_counts(StatsWrapperObject *self, PyObject *unused)
+{
+    statscounters counters;
+    collect_counters(self, &counters, NULL, 0);
+    return counts_to_tuple(&counters);
+}
+
+
+static PyObject *histogram_to_dict(
+        const Py_ssize_t *histogram, int64_t min_time, int64_t max_time);
+
+
+/* Add the CPU time keys (if enabled) */
+static int
+add_cpu_timing(StatsWrapperObject *self, int64_t *slots, PyObject *timing)
+{
+    int64_t *cpu = &slots[self->cpu_slots];
+    Py_ssize_t histogram[HIST_BUCKETS];
+    for (Py_ssize_t i = 0; i < HIST_BUCKETS; i++) {
+        histogram[i] = (Py_ssize_t)cpu[i];
+    }
+    double avg_time = 0.0;
+    if (cpu[CPU_TIMED_OFFSET] > 0) {
+        avg_time = (double)cpu[CPU_TIME_OFFSET] / cpu[CPU_TIMED_OFFSET];
+    }
+    PyObject *values[3] = {
+        PyFloat_FromDouble(cpu[CPU_EST_TIME_OFFSET] * 1e-9),
+        PyFloat_FromDouble(avg_time * 1e-9),
+        histogram_to_dict(histogram, 0, INT64_MAX),
+    };
+    static const char *keys[3] = {"cpu_total", "cpu_average", "cpu_histogram"};
+    int res = 0;
+    for (int i = 0; i < 3; i++) {
+        if (res == 0 && (values[i] == NULL ||
+                PyDict_SetItemString(timing, keys[i], values[i]) < 0)) {
+            res = -1;
+        }
+        Py_XDECREF(values[i]);
+    }
+    return res;
+}
+
+
+/* `slots` may be NULL if CPU times are not enabled */
+static PyObject *
+timing_to_dict(StatsWrapperObject *self, statscounters *counters,
+        int64_t *slots)
+{
+    /* If all calls were timed, this is exactly the total time. */
+    double total_time = (double)counters->est_total_time;
+    double avg_time = 0.0;
+    if (counters->timed_calls > 0) {
+        avg_time = (double)counters->total_time / counters->timed_calls;
+    }
+    PyObject *res = Py_BuildValue("{s:d,s:d,s:d,s:d,s:d,s:d,s:d,s:n}",
+        "total", total_time * 1e-9,
+        "self", counters->est_self_time * 1e-9,
+        "outermost", counters->est_outer_time * 1e-9,
+        "wall", counters->est_wall_time * 1e-9,
+        "average", avg_time * 1e-9,
+        "min", counters->min_time * 1e-9,
+        "max", counters->max_time * 1e-9,
+        "samples", counters->timed_calls);
+    if (res != NULL && self->cpu_slots >= 0 &&
+            add_cpu_timing(self, slots, res) < 0) {
+        Py_CLEAR(res);
+    }
+    return res;
+}
+
+
+static PyObject *
+statswrapper__get_timing(StatsWrapperObject *self, PyObject *unused)
+{
+    statscounters counters;
+    if (self->cpu_slots < 0) {
+        collect_counters(self, &counters, NULL, 0);
+        return timing_to_dict(self, &counters, NULL);
+    }
+    int64_t *slots = PyMem_Malloc(self->counters_stride);
+    if (slots == NULL) {
+        return PyErr_NoMemory();
+    }
+    collect_counters(self, &counters, slots, 0);
+    PyObject *res = timing_to_dict(self, &counters, slots);
+    PyMem_Free(slots);
+    return res;
+}
+
+
+/*
+ * All live wrappers sorted by `wrapper_id` (strong references), so that
+ * exporting the callers of many wrappers does not walk the registry for
+ * each of them.
+ */
+typedef struct {
+    Py_ssize_t n;
+    StatsWrapperObject **wrappers;
+} wrapper_index;
+
+
+static int
+compare_wrapper_ids(const void *a, const void *b)
+{
+    uint64_t id_a = (*(StatsWrapperObject *const *)a)->wrapper_id;
+    uint64_t id_b = (*(StatsWrapperObject *const *)b)->wrapper_id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+
+static int
+wrapper_index_build(wrapper_index *index)
+{
+    Py_ssize_t n = 0;
+    REGISTRY_LOCK();
+    for (StatsWrapperObject *w = registry_head; w != NULL; w = w->registry_next) {
+        n++;
+    }
+    REGISTRY_UNLOCK();
+
+    index->n = 0;
+    index->wrappers = PyMem_Calloc(n + 1, sizeof(StatsWrapperObject *));
+    if (index->wrappers == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    REGISTRY_LOCK();
+    for (StatsWrapperObject *w = registry_head;
+            w != NULL && index->n < n; w = w->registry_next) {
+        if (Py_REFCNT(w) == 0) {
+            continue;  /* being deallocated (free-threading) */
+        }
+        Py_INCREF(w);
+        index->wrappers[index->n++] = w;
+    }
+    REGISTRY_UNLOCK();
+    qsort(index->wrappers, index->n, sizeof(StatsWrapperObject *),
+          compare_wrapper_ids);
+    return 0;
+}
+
+
+/* Borrowed reference to the wrapper with `id` or NULL */
+static StatsWrapperObject *
+wrapper_index_find(wrapper_index *index, uint64_t id)
+{
+    Py_ssize_t lo = 0, hi = index->n;
+    while (lo < hi) {
+        Py_ssize_t mid = lo + (hi - lo) / 2;
+        uint64_t mid_id = index->wrappers[mid]->wrapper_id;
+        if (mid_id == id) {
+            return index->wrappers[mid];
+        }
+        if (mid_id < id) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+
+static void
+wrapper_index_clear(wrapper_index *index)
+{
+    for (Py_ssize_t i = 0; i < index->n; i++) {
+        Py_DECREF(index->wrappers[i]);
+    }
+    PyMem_Free(index->wrappers);
+    index->wrappers = NULL;
+    index->n = 0;
+}
+
+
+/*
+ * List of (caller, calls, time, self time) tuples, the caller is None for
+ * callers that were deallocated or did not fit into the table.  The callers
+ * are looked up in `index` if given, otherwise in the registry.
+ */
+static PyObject *
+callers_to_list(StatsWrapperObject *self, callercounters *counters,
+        wrapper_index *index)
+{
+    PyObject *callers[CALLER_TABLE_SIZE + 1] = {NULL};
+    if (index != NULL) {
+        for (Py_ssize_t i = 0; i < CALLER_TABLE_SIZE; i++) {
+#ifdef Py_GIL_DISABLED
+            uint64_t id = _Py_atomic_load_uint64_relaxed(&self->callers[i]);
+#else
+            uint64_t id = self->callers[i];
+#endif
+            if (id != 0) {
+                callers[i] = (PyObject *)wrapper_index_find(index, id);
+                Py_XINCREF(callers[i]);
+            }
+        }
+        goto found;
+    }
+    /* Find the live callers first, without allocating under the lock. */
+    REGISTRY_LOCK();
+    for (StatsWrapperObject *w = registry_head; w != NULL; w = w->registry_next) {
+        if (Py_REFCNT(w) == 0) {
+            continue;  /* being deallocated (free-threading) */
+        }
+        for (Py_ssize_t i = 0; i < CALLER_TABLE_SIZE; i++) {
+#ifdef Py_GIL_DISABLED
+            uint64_t id = _Py_atomic_load_uint64_relaxed(&self->callers[i]);
+#else
+            uint64_t id = self->callers[i];
+#endif
+            if (id != 0 && id == w->wrapper_id) {
+                Py_INCREF(w);
+                callers[i] = (PyObject *)w;
+                break;
+            }
+        }
+    }
+    REGISTRY_UNLOCK();
+
+  found:
+    /* Fold the callers that are gone into "other" */
+    int64_t other[3] = {0, 0, 0};
+    PyObject *res = PyList_New(0);
+    if (res == NULL) {
+        goto finish;
+    }
+    for (Py_ssize_t i = 0; i < CALLER_TABLE_SIZE + 1; i++) {
+        if (counters->calls[i] == 0) {
+            continue;
+        }
+        if (callers[i] == NULL) {
+            other[0] += counters->calls[i];
+            other[1] += counters->time[i];
+            other[2] += counters->self_time[i];
+            continue;
+        }
+        PyObject *item = Py_BuildValue("OLdd", callers[i],
+            (long long)counters->calls[i],
+            counters->time[i] * 1e-9,
+            counters->self_time[i] * 1e-9);
+        if (item == NULL || PyList_Append(res, item) < 0) {
+            Py_XDECREF(item);
+            Py_CLEAR(res);
+            goto finish;
+        }
+        Py_DECREF(item);
+    }
+    if (other[0] != 0) {
+        PyObject *item = Py_BuildValue("OLdd", Py_None, (long long)other[0],
+            other[1] * 1e-9, other[2] * 1e-9);
+        if (item == NULL || PyList_Append(res, item) < 0) {
+            Py_XDECREF(item);
+            Py_CLEAR(res);
+            goto finish;
+        }
+        Py_DECREF(item);
+    }
+
+  finish:
+    for (Py_ssize_t i = 0; i < CALLER_TABLE_SIZE + 1; i++) {
+        Py_XDECREF(callers[i]);
+    }
+    return res;
+}
+
+
+static PyObject *
+statswrapper__get_callers(StatsWrapperObject *self, PyObject *unused)
+{
+    callercounters counters;
+    collect_caller_counters(self, &counters, 0);
+    return callers_to_list(self, &counters, NULL);
+}
+
+
+/*
+ * Estimate a quantile from the histogram.  Returns the middle of the bucket
+ * containing it, clipped to the observed min/max.
+ */
+static double
+histogram_quantile(const Py_ssize_t *histogram, int64_t min_time,
+        int64_t max_time, double q)
+{
+    Py_ssize_t total = 0;
+    for (Py_ssize_t i = 0; i < HIST_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+    double rank = q * total;
+    Py_ssize_t cumulative = 0;
+    Py_ssize_t bucket = 0;
+    for (; bucket < HIST_BUCKETS - 1; bucket++) {
+        cumulative += histogram[bucket];
+        if (cumulative > 0 && cumulative >= rank) {
+            break;
+        }
+    }
+    double start = (double)histogram_bucket_start(bucket);
+    double end = (double)histogram_bucket_start(bucket + 1);
+    double value = (start + end) / 2;
+    if (value < min_time) {
+        value = (double)min_time;
+    }
+    if (value > max_time) {
+        value = (double)max_time;
+    }
+    return value * 1e-9;
+}
+
+
+/* The min/max are only used to clip the quantiles */
+static PyObject *
+histogram_to_dict(const Py_ssize_t *histogram, int64_t min_time,
+        int64_t max_time)
+{
+    PyObject *buckets = PyTuple_New(HIST_BUCKETS);
+    if (buckets == NULL) {
+        return NULL;
+    }
+    PyObject *bounds = PyTuple_New(HIST_BUCKETS);
+    if (bounds == NULL) {
+        Py_DECREF(buckets);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < HIST_BUCKETS; i++) {
+        PyObject *count = PyLong_FromSsize_t(histogram[i]);
+        if (count == NULL) {
+            goto fail;
+        }
+        PyTuple_SET_ITEM(buckets, i, count);
+        PyObject *bound = PyFloat_FromDouble(histogram_bucket_start(i) * 1e-9);
+        if (bound == NULL) {
+            goto fail;
+        }
+        PyTuple_SET_ITEM(bounds, i, bound);
+    }
+    return Py_BuildValue("{s:d,s:d,s:d,s:d,s:N,s:N}",
+        "p50", histogram_quantile(histogram, min_time, max_time, 0.5),
+        "p90", histogram_quantile(histogram, min_time, max_time, 0.9),
+        "p99", histogram_quantile(histogram, min_time, max_time, 0.99),
+        "p999", histogram_quantile(histogram, min_time, max_time, 0.999),
+        "buckets", buckets,
+        "lower_bounds", bounds);
+
+  fail:
+    Py_DECREF(buckets);
+    Py_DECREF(bounds);
+    return NULL;
+}
+
+
+static PyObject *
+statswrapper__get_histogram(StatsWrapperObject *self, PyObject *unused)
+{
+    statscounters counters;
+    Py_ssize_t histogram[HIST_BUCKETS];
+    collect_counters(self, &counters, NULL, 0);
+    collect_histogram(self, histogram, 0);
+    return histogram_to_dict(histogram, counters.min_time, counters.max_time);
+}
+
+
+static inline PyObject *
+kwname_or_none(StatsWrapperObject *self, Py_ssize_t i)
+{
+    PyObject *kwname = self->spec != NULL ? self->spec->args[i].kwname : NULL;
+    return kwname != NULL ? kwname : Py_None;
+}
+
+
+static PyObject *
+param_stats_to_tuple(StatsWrapperObject *self, int64_t *slots)
+{
+    PyObject *res = PyTuple_New(Py_SIZE(self) - 1);
+    if (res == NULL) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        arginfo *info = &self->args[i];
+        PyObject *known_params = info->known_params;
+        PyObject *param_counts;
+        if (known_params == NULL) {
+            known_params = Py_None;
+            Py_INCREF(Py_None);
+            param_counts = Py_None;
+        }
+        else {
+            Py_ssize_t n_known_params = PyTuple_GET_SIZE(known_params);
+            param_counts = PyTuple_New(n_known_params);
+            if (param_counts == NULL) {
+                goto fail;
+            }
+            for (Py_ssize_t j = 0; j < n_known_params; j++) {
+                PyObject *count = PyLong_FromLongLong(slots[info->param_slots + j]);
+                if (count == NULL) {
+                    Py_DECREF(param_counts);
+                    goto fail;
+                }
+                PyTuple_SET_ITEM(param_counts, j, count);
+            }
+        }
+        PyObject *item = Py_BuildValue("OLON",
+            kwname_or_none(self, i),
+            (long long)slots[info->count_slot], known_params, param_counts);
+        if (item == NULL) {
+            goto fail;
+        }
+        PyTuple_SET_ITEM(res, i, item);
+    }
+    return res;
+
+  fail:
+    Py_DECREF(res);
+    return NULL;
+}
+
+
+static PyObject *
+statswrapper__get_param_stats(StatsWrapperObject *self, PyObject *unused)
+{
+    statscounters counters;
+    int64_t *slots = PyMem_Malloc(self->counters_stride);
+    if (slots == NULL) {
+        return PyErr_NoMemory();
+    }
+    collect_counters(self, &counters, slots, 0);
+    PyObject *res = param_stats_to_tuple(self, slots);
+    PyMem_Free(slots);
+    return res;
+}
+
+
+static PyObject *
+type_stats_to_tuple(StatsWrapperObject *self, int64_t *slots)
+{
+    PyObject *res = PyTuple_New(Py_SIZE(self) - 1);
+    if (res == NULL) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        arginfo *info = &self->args[i];
+        PyObject *item;
+        if (info->types == NULL) {
+            item = Py_BuildValue("OOn",
+                kwname_or_none(self, i), Py_None, (Py_ssize_t)0);
+        }
+        else {
+            PyObject *types = PyDict_New();
+            if (types == NULL) {
+                goto fail;
+            }
+            for (Py_ssize_t j = 0; j < TYPE_TABLE_SIZE; j++) {
+#ifdef Py_GIL_DISABLED
+                PyTypeObject *type = _Py_atomic_load_ptr_relaxed(&info->types[j]);
+#else
+                PyTypeObject *type = info->types[j];
+#endif
+                if (type == NULL) {
+                    continue;
+                }
+                PyObject *count = PyLong_FromLongLong(slots[info->type_slots + j]);
+                if (count == NULL ||
+                        PyDict_SetItem(types, (PyObject *)type, count) < 0) {
+                    Py_XDECREF(count);
+                    Py_DECREF(types);
+                    goto fail;
+                }
+                Py_DECREF(count);
+            }
+            item = Py_BuildValue("ONL",
+                kwname_or_none(self, i), types,
+                (long long)slots[info->type_slots + TYPE_TABLE_SIZE]);
+        }
+        if (item == NULL) {
+            goto fail;
+        }
+        PyTuple_SET_ITEM(res, i, item);
+    }
+    return res;
+
+  fail:
+    Py_DECREF(res);
+    return NULL;
+}
+
+
+static PyObject *
+statswrapper__get_type_stats(StatsWrapperObject *self, PyObject *unused)
+{
+    statscounters counters;
+    int64_t *slots = PyMem_Malloc(self->counters_stride);
+    if (slots == NULL) {
+        return PyErr_NoMemory();
+    }
+    collect_counters(self, &counters, slots, 0);
+    PyObject *res = type_stats_to_tuple(self, slots);
+    PyMem_Free(slots);
+    return res;
+}
+
+
+static PyObject *
+array_stats_to_dict(arginfo *info, int64_t *slots)
+{
+    int64_t *array_slots = slots + info->array_slots;
+    PyObject *sizes = PyDict_New();
+    PyObject *size_timing = PyDict_New();
+    PyObject *ndims = PyDict_New();
+    PyObject *dtypes = PyDict_New();
+    PyObject *res = NULL;
+    if (sizes == NULL || size_timing == NULL || ndims == NULL || dtypes == NULL) {
+        goto finish;
+    }
+    for (Py_ssize_t i = 0; i < ARRAY_SIZE_BUCKETS; i++) {
+        if (array_slots[i] == 0) {
+            continue;
+        }
+        /* Key by the smallest size in the bucket */
+        PyObject *key = PyLong_FromLongLong(i == 0 ? 0 : (long long)1 << (i - 1));
+        PyObject *count = PyLong_FromLongLong(array_slots[i]);
+        int err = (key == NULL || count == NULL ||
+                   PyDict_SetItem(sizes, key, count) < 0);
+        Py_XDECREF(count);
+        int64_t timed = array_slots[ARRAY_TIMED_OFFSET + i];
+        if (!err && timed > 0) {
+            PyObject *avg = PyFloat_FromDouble(
+                    (double)array_slots[ARRAY_TIME_OFFSET + i] / timed * 1e-9);
+            err = (avg == NULL || PyDict_SetItem(size_timing, key, avg) < 0);
+            Py_XDECREF(avg);
+        }
+        Py_XDECREF(key);
+        if (err) {
+            goto finish;
+        }
+    }
+    for (Py_ssize_t i = 0; i < ARRAY_NDIM_SLOTS; i++) {
+        int64_t count = array_slots[ARRAY_NDIM_OFFSET + i];
+        if (count == 0) {
+            continue;
+        }
+        PyObject *key = PyLong_FromSsize_t(i);
+        PyObject *value = PyLong_FromLongLong(count);
+        int err = (key == NULL || value == NULL ||
+                   PyDict_SetItem(ndims, key, value) < 0);
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        if (err) {
+            goto finish;
+        }
+    }
+    for (Py_ssize_t i = 0; i < DTYPE_TABLE_MAX; i++) {
+#ifdef Py_GIL_DISABLED
+        PyObject *dtype = _Py_atomic_load_ptr_acquire(&info->dtypes[i]);
+#else
+        PyObject *dtype = info->dtypes[i];
+#endif
+        if (dtype == NULL) {
+            break;
+        }
+        PyObject *count = PyLong_FromLongLong(array_slots[ARRAY_DTYPE_OFFSET + i]);
+        int err = (count == NULL || PyDict_SetItem(dtypes, dtype, count) < 0);
+        Py_XDECREF(count);
+        if (err) {
+            goto finish;
+        }
+    }
+    res = Py_BuildValue("{s:O,s:O,s:O,s:O,s:L,s:L}",
+            "sizes", sizes, "size_timing", size_timing,
+            "ndim", ndims, "dtypes", dtypes,
+            "other_dtypes", (long long)array_slots[ARRAY_DTYPE_OFFSET + DTYPE_TABLE_MAX],
+            "unsized", (long long)array_slots[ARRAY_UNSIZED_OFFSET]);
+  finish:
+    Py_XDECREF(sizes);
+    Py_XDECREF(size_timing);
+    Py_XDECREF(ndims);
+    Py_XDECREF(dtypes);
+    return res;
+}
+
+
+static PyObject *
+array_stats_to_tuple(StatsWrapperObject *self, int64_t *slots)
+{
+    PyObject *res = PyTuple_New(Py_SIZE(self) - 1);
+    if (res == NULL) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        arginfo *info = &self->args[i];
+        PyObject *stats = Py_None;
+        Py_INCREF(Py_None);
+        if (info->dtypes != NULL) {
+            Py_DECREF(Py_None);
+            stats = array_stats_to_dict(info, slots);
+            if (stats == NULL) {
+                Py_DECREF(res);
+                return NULL;
+            }
+        }
+        PyObject *item = Py_BuildValue("ON",
+                kwname_or_none(self, i), stats);
+        if (item == NULL) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(res, i, item);
+    }
+    return res;
+}
+
+
+static PyObject *
+statswrapper__get_array_stats(StatsWrapperObject *self, PyObject *unused)
+{
+    statscounters counters;
+    int64_t *slots = PyMem_Malloc(self->counters_stride);
+    if (slots == NULL) {
+        return PyErr_NoMemory();
+    }
+    collect_counters(self, &counters, slots, 0);
+    PyObject *res = array_stats_to_tuple(self, slots);
+    PyMem_Free(slots);
+    return res;
+}
+
+
+/* The counters of a wrapper moved out by `snapshot_take()` */
+typedef struct {
+    statscounters counters;
+    Py_ssize_t histogram[HIST_BUCKETS];
+    callercounters callers;
+    int64_t *slots;
+    PyObject *sketch;  // None if not enabled
+} snapshot_taken;
+
+
+/*
+ * Move all counters of `self` into `taken` (zeroing them), so that each
+ * call is seen by exactly one snapshot.  Nothing is taken on errors.
+ */
+static int
+snapshot_take(StatsWrapperObject *self, snapshot_taken *taken)
+{
+    taken->slots = PyMem_Malloc(self->counters_stride);
+    if (taken->slots == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    taken->sketch = Py_None;
+    Py_INCREF(Py_None);
+    if (self->sketch != NULL) {
+        Py_DECREF(Py_None);
+        taken->sketch = (PyObject *)sketch_take(self->sketch);
+        if (taken->sketch == NULL) {
+            PyMem_Free(taken->slots);
+            return -1;
+        }
+    }
+    /* Nothing may fail between taking the sketch and the counters. */
+    collect_counters(self, &taken->counters, taken->slots, 1);
+    collect_histogram(self, taken->histogram, 1);
+    collect_caller_counters(self, &taken->callers, 1);
+    COUNTER_ADD(self->reset_calls, taken->counters.total_calls);
+    return 0;
+}
+
+
+static void
+snapshot_taken_clear(snapshot_taken *taken)
+{
+    PyMem_Free(taken->slots);
+    taken->slots = NULL;
+    Py_CLEAR(taken->sketch);
+}
+
+
+/*
+ * Add the counters of `taken` back into the current shard of `self` and
+ * clear it, if they could not be reported.  (Only samples of the sketch
+ * may be lost if merging them back runs out of memory.)
+ */
+static void
+snapshot_restore(StatsWrapperObject *self, snapshot_taken *taken)
+{
+    statscounters *c = get_counters(self);
+    statscounters *t = &taken->counters;
+    COUNTER_ADD(self->reset_calls, -t->total_calls);
+    COUNTER_ADD(c->total_calls, t->total_calls);
+    COUNTER_ADD(c->invalid_args, t->invalid_args);
+    COUNTER_ADD(c->error_results, t->error_results);
+    COUNTER_ADD(c->timed_calls, t->timed_calls);
+    COUNTER_ADD64(c->total_time, t->total_time);
+    COUNTER_ADD64(c->est_total_time, t->est_total_time);
+    COUNTER_ADD64(c->est_self_time, t->est_self_time);
+    COUNTER_ADD64(c->est_outer_time, t->est_outer_time);
+    COUNTER_ADD64(c->est_wall_time, t->est_wall_time);
+    if (t->timed_calls != 0) {
+        counter_min64(&c->min_time, t->min_time);
+        counter_max64(&c->max_time, t->max_time);
+        Py_ssize_t *histogram = get_histogram(self);
+        for (Py_ssize_t i = 0; histogram != NULL && i < HIST_BUCKETS; i++) {
+            if (taken->histogram[i] != 0) {
+                COUNTER_ADD(histogram[i], taken->histogram[i]);
+            }
+        }
+    }
+    Py_ssize_t nslots = (self->counters_stride - sizeof(statscounters))
+                        / sizeof(int64_t);
+    for (Py_ssize_t i = 0; i < nslots; i++) {
+        if (taken->slots[i] != 0) {
+            COUNTER_ADD64(c->slots[i], taken->slots[i]);
+        }
+    }
+    for (Py_ssize_t i = 0; i < CALLER_TABLE_SIZE + 1; i++) {
+        if (taken->callers.calls[i] != 0 || taken->callers.time[i] != 0 ||
+                taken->callers.self_time[i] != 0) {
+            record_caller(self, i, taken->callers.calls[i],
+                    taken->callers.time[i], taken->callers.self_time[i]);
+        }
+    }
+    if (taken->sketch != Py_None) {
+        PyObject *exc_type, *exc_value, *exc_tb;
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        SKETCH_LOCK(self->sketch);
+        if (sketch_merge(self->sketch,
+                (QuantileSketchObject *)taken->sketch) < 0) {
+            PyErr_Clear();
+        }
+        SKETCH_UNLOCK(self->sketch);
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    }
+    snapshot_taken_clear(taken);
+}
+
+
+/*
+ * The stats (as the `_get_*` methods would return them) of the counters
+ * taken by `snapshot_take()`.  The callers are looked up in `index` if
+ * given (see `callers_to_list()`).
+ */
+static PyObject *
+snapshot_to_dict(StatsWrapperObject *self, snapshot_taken *taken,
+        wrapper_index *index)
+{
+    static const char *keys[] = {
+        "counts", "timing", "histogram", "param_stats", "type_stats",
+        "array_stats", "callers", "sketch"
+    };
+    statscounters *counters = &taken->counters;
+    PyObject *values[8] = {NULL};
+    values[7] = taken->sketch;
+    Py_INCREF(values[7]);
+    PyObject *res = NULL;
+    if ((values[0] = counts_to_tuple(counters)) == NULL ||
+            (values[1] = timing_to_dict(self, counters, taken->slots)) == NULL ||
+            (values[2] = histogram_to_dict(taken->histogram,
+                    counters->min_time, counters->max_time)) == NULL ||
+            (values[3] = param_stats_to_tuple(self, taken->slots)) == NULL ||
+            (values[4] = type_stats_to_tuple(self, taken->slots)) == NULL ||
+            (values[5] = array_stats_to_tuple(self, taken->slots)) == NULL ||
+            (values[6] = callers_to_list(self, &taken->callers, index)) == NULL) {
+        goto finish;
+    }
+    res = PyDict_New();
+    if (res == NULL) {
+        goto finish;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (PyDict_SetItemString(res, keys[i], values[i]) < 0) {
+            Py_CLEAR(res);
+            goto finish;
+        }
+    }
+
+  finish:
+    for (int i = 0; i < 8; i++) {
+        Py_XDECREF(values[i]);
+    }
+    return res;
+}
+
+
+/*
+ * Return all stats (as the `_get_*` methods would) and reset them in one
+ * step, so that periodic exports see each call exactly once.  If the stats
+ * cannot be returned, the counters are put back.
+ */
+static PyObject *
+statswrapper__snapshot_and_reset(StatsWrapperObject *self, PyObject *unused)
+{
+    snapshot_taken taken;
+    if (snapshot_take(self, &taken) < 0) {
+        return NULL;
+    }
+    PyObject *res = snapshot_to_dict(self, &taken, NULL);
+    if (res == NULL) {
+        snapshot_restore(self, &taken);
+    }
+    snapshot_taken_clear(&taken);
+    return res;
+}
+
+
+static int allocate_counters(StatsWrapperObject *self);
+static void update_vectorcall(StatsWrapperObject *self);
+
+
+/*
+ * Changing the counter layout is only possible before the first call
+ * (counters are not copied and a concurrent call could use the old layout).
+ */
+static int
+check_unused(StatsWrapperObject *self, const char *what)
+{
+    statscounters counters;
+    collect_counters(self, &counters, NULL, 0);
+    if (counters.total_calls != 0 || COUNTER_LOAD(self->reset_calls) != 0) {
+        PyErr_Format(PyExc_RuntimeError,
+                "%s must be enabled before the first call.", what);
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject *
+statswrapper__enable_type_stats(StatsWrapperObject *self, PyObject *unused)
+{
+    if (self->args[0].types != NULL || Py_SIZE(self) == 1) {
+        Py_RETURN_NONE;  /* already enabled (or no arguments) */
+    }
+    if (check_unused(self, "type stats") < 0) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        self->args[i].types = PyMem_Calloc(TYPE_TABLE_SIZE, sizeof(PyTypeObject *));
+        if (self->args[i].types == NULL) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+    }
+    if (allocate_counters(self) < 0) {
+        goto fail;
+    }
+    update_vectorcall(self);
+    Py_RETURN_NONE;
+
+  fail:
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        PyMem_Free(self->args[i].types);
+        self->args[i].types = NULL;
+    }
+    return NULL;
+}
+
+
+static PyObject *
+statswrapper__enable_cpu_time(StatsWrapperObject *self, PyObject *unused)
+{
+#ifndef HAVE_THREAD_CPU_TIME
+    PyErr_SetString(PyExc_NotImplementedError,
+            "No thread CPU time clock on this platform.");
+    return NULL;
+#else
+    if (self->cpu_slots >= 0) {
+        Py_RETURN_NONE;
+    }
+    if (check_unused(self, "CPU time") < 0) {
+        return NULL;
+    }
+    self->cpu_slots = 0;  /* placed by `allocate_counters()` */
+    if (allocate_counters(self) < 0) {
+        self->cpu_slots = -1;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+#endif
+}
+
+
+/*
+ * Enable array stats for the given arguments (by index or keyword name), or
+ * for all arguments if none are given.
+ */
+static PyObject *
+statswrapper__enable_array_stats(StatsWrapperObject *self, PyObject *args)
+{
+    Py_ssize_t nargs = Py_SIZE(self) - 1;
+    char *enable = PyMem_Calloc(nargs + 1, 1);
+    if (enable == NULL) {
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); i++) {
+        PyObject *which = PyTuple_GET_ITEM(args, i);
+        Py_ssize_t idx = -1;
+        if (PyUnicode_Check(which)) {
+            idx = resolve_kwname(self, which);
+        }
+        else if (PyLong_Check(which)) {
+            idx = PyLong_AsSsize_t(which);
+        }
+        if (idx < 0 || idx >= nargs) {
+            if (!PyErr_Occurred()) {
+                PyErr_Format(PyExc_ValueError,
+                        "%R is not a tracked argument.", which);
+            }
+            PyMem_Free(enable);
+            return NULL;
+        }
+        enable[idx] = 1;
+    }
+    if (PyTuple_GET_SIZE(args) == 0) {
+        memset(enable, 1, nargs);
+    }
+
+    int changed = 0;
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        changed |= enable[i] && self->args[i].dtypes == NULL;
+    }
+    if (!changed) {
+        PyMem_Free(enable);
+        Py_RETURN_NONE;
+    }
+    if (check_unused(self, "array stats") < 0) {
+        PyMem_Free(enable);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        if (enable[i] && self->args[i].dtypes == NULL) {
+            enable[i] = 2;  /* newly enabled */
+            self->args[i].dtypes = PyMem_Calloc(DTYPE_TABLE_MAX, sizeof(PyObject *));
+            if (self->args[i].dtypes == NULL) {
+                PyErr_NoMemory();
+                goto fail;
+            }
+        }
+    }
+    if (allocate_counters(self) < 0) {
+        goto fail;
+    }
+    update_vectorcall(self);
+    PyMem_Free(enable);
+    Py_RETURN_NONE;
+
+  fail:
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        if (enable[i] == 2) {
+            PyMem_Free(self->args[i].dtypes);
+            self->args[i].dtypes = NULL;
+        }
+    }
+    PyMem_Free(enable);
+    return NULL;
+}
+
+
+static PyObject *
+statswrapper__set_sampling(StatsWrapperObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"interval", "max_rate", NULL};
+    Py_ssize_t interval = 1;
+    Py_ssize_t max_rate = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nn:_set_sampling", kwlist,
+            &interval, &max_rate)) {
+        return NULL;
+    }
+    if (interval < 0 || max_rate < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                "sampling interval and max_rate must not be negative.");
+        return NULL;
+    }
+    if (interval == 0 && max_rate > 0) {
+        PyErr_SetString(PyExc_ValueError,
+                "max_rate requires timing to be enabled (interval >= 1).");
+        return NULL;
+    }
+    self->max_sample_rate = max_rate;
+    int64_t now = monotonic_ns();
+    for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+        statscounters *counters = get_shard(self, shard);
+        COUNTER_STORE(counters->sample_interval, interval);
+        /* An interval of 0 means timing is disabled, never count down to it. */
+        COUNTER_STORE(counters->sample_countdown, interval ? 1 : PY_SSIZE_T_MAX);
+        COUNTER_STORE(counters->window_samples, 0);
+        COUNTER_STORE64(counters->window_start, now);
+    }
+    update_vectorcall(self);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+statswrapper__enable_sketch(StatsWrapperObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"relative_accuracy", "max_bins", NULL};
+    double relative_accuracy = 0.01;
+    Py_ssize_t max_bins = 2048;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dn:_enable_sketch", kwlist,
+            &relative_accuracy, &max_bins)) {
+        return NULL;
+    }
+    if (self->sketch != NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                "the quantile sketch is already enabled.");
+        return NULL;
+    }
+    self->sketch = sketch_new(relative_accuracy, max_bins);
+    if (self->sketch == NULL) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+statswrapper__get_sketch(StatsWrapperObject *self, PyObject *unused)
+{
+    if (self->sketch == NULL) {
+        Py_RETURN_NONE;
+    }
+    return sketch_copy(self->sketch, NULL);
+}
+
+
+static PyObject *
+statswrapper__set_npos(StatsWrapperObject *self, PyObject *arg)
+{
+    Py_ssize_t npos = PyLong_AsSsize_t(arg);
+    if (npos == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (npos < self->npos_only || npos > Py_SIZE(self) - 1) {
+        PyErr_SetString(PyExc_ValueError,
+                "invalid new value for npos for the function.");
+    }
+    self->npos = npos;
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * The vectorcall function to use for a wrapper, must be called with the
+ * registry lock held.
+ */
+static vectorcallfunc
+select_vectorcall(StatsWrapperObject *self)
+{
+    if (self->wrapped == NULL) {
+        return (vectorcallfunc)statswrapper_cleared;
+    }
+    if (!stats_enabled || self->monitored_code != NULL) {
+        return (vectorcallfunc)statswrapper_passthrough;
+    }
+    int simple = self->gen_kind == GEN_NONE;
+    for (Py_ssize_t i = 0; simple && i < Py_SIZE(self) - 1; i++) {
+        arginfo *info = &self->args[i];
+        simple = info->known_params == NULL && info->dtypes == NULL;
+    }
+    int timed = (self->max_sample_rate > 0
+                 || COUNTER_LOAD(get_shard(self, 0)->sample_interval) != 0);
+    if (simple) {
+        return timed ? (vectorcallfunc)statswrapper_vectorcall_simple
+                     : (vectorcallfunc)statswrapper_vectorcall_simple_untimed;
+    }
+    return timed ? (vectorcallfunc)statswrapper_vectorcall
+                 : (vectorcallfunc)statswrapper_vectorcall_untimed;
+}
+
+
+static void
+set_vectorcall(StatsWrapperObject *self, vectorcallfunc func)
+{
+#ifdef Py_GIL_DISABLED
+    _Py_atomic_store_ptr_relaxed(&self->vectorcall, (void *)func);
+#else
+    self->vectorcall = func;
+#endif
+}
+
+
+/* Switch to the call implementation matching the current configuration */
+static void
+update_vectorcall(StatsWrapperObject *self)
+{
+    REGISTRY_LOCK();
+    set_vectorcall(self, select_vectorcall(self));
+    REGISTRY_UNLOCK();
+}
+
+
+/*
+ * Build the hash table for looking up the tracked values of an argument.
+ * Of several equal values, only the first one is entered (and counted).
+ */
+static int
+build_param_table(argspec *spec)
+{
+    Py_ssize_t n_params = PyTuple_GET_SIZE(spec->known_params);
+    size_t size = 4;
+    while (size < 2 * (size_t)n_params) {
+        size *= 2;
+    }
+    param_entry *table = PyMem_Malloc(size * sizeof(param_entry));
+    spec->unhashed = PyMem_Malloc(n_params * sizeof(Py_ssize_t) + 1);
+    if (table == NULL || spec->unhashed == NULL) {
+        PyMem_Free(table);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        table[i].index = -1;
+    }
+
+    Py_ssize_t n_hashable = 0;
+    for (Py_ssize_t idx = 0; idx < n_params; idx++) {
+        PyObject *param = PyTuple_GET_ITEM(spec->known_params, idx);
+        if (!has_builtin_hash(param)) {
+            spec->unhashed[spec->n_unhashed++] = idx;
+            continue;
+        }
+        Py_hash_t hash = PyObject_Hash(param);
+        if (hash == -1) {
+            if (!PyErr_ExceptionMatches(PyExc_TypeError)) {
+                PyMem_Free(table);
+                return -1;
+            }
+            PyErr_Clear();
+            spec->unhashed[spec->n_unhashed++] = idx;
+            continue;
+        }
+        size_t i = (size_t)hash & (size - 1);
+        for (; table[i].index >= 0; i = (i + 1) & (size - 1)) {
+            if (table[i].hash != hash) {
+                continue;
+            }
+            int eq = PyObject_RichCompareBool(
+                    PyTuple_GET_ITEM(spec->known_params, table[i].index),
+                    param, Py_EQ);
+            if (eq < 0) {
+                PyMem_Free(table);
+                return -1;
+            }
+            if (eq) {
+                break;
+            }
+        }
+        if (table[i].index < 0) {
+            table[i].hash = hash;
+            table[i].index = idx;
+            n_hashable++;
+        }
+    }
+    if (n_hashable == 0) {
+        PyMem_Free(table);
+        return 0;
+    }
+    spec->param_table = table;
+    spec->param_mask = size - 1;
+    return 0;
+}
+
+
+/*
+ * Interned `SignatureSpecObject`s by `(npos_only, kwnames, *known_params)`.
+ * The dict holds a reference, the last wrapper using a spec removes it.
+ * It is a root the garbage collector cannot see through, so only specs
+ * whose tracked values cannot be part of a reference cycle are interned
+ * (see `signature_spec_internable()`).
+ */
+static PyObject *signature_specs = NULL;
+
+#ifdef Py_GIL_DISABLED
+#define SIGNATURE_SPECS_LOCK() Py_BEGIN_CRITICAL_SECTION(signature_specs)
+#define SIGNATURE_SPECS_UNLOCK() Py_END_CRITICAL_SECTION()
+#else
+#define SIGNATURE_SPECS_LOCK()
+#define SIGNATURE_SPECS_UNLOCK()
+#endif
+
+
+static void
+signature_spec_dealloc(SignatureSpecObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        Py_XDECREF(self->args[i].kwname);
+        Py_XDECREF(self->args[i].known_params);
+        PyMem_Free(self->args[i].param_table);
+        PyMem_Free(self->args[i].unhashed);
+    }
+    Py_XDECREF(self->key);
+    PyObject_GC_Del(self);
+}
+
+
+/* Tracked values may reference wrappers, so specs can be part of cycles. */
+static int
+signature_spec_traverse(SignatureSpecObject *self, visitproc visit, void *arg)
+{
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        Py_VISIT(self->args[i].known_params);
+    }
+    Py_VISIT(self->key);
+    return 0;
+}
+
+
+static PyTypeObject SignatureSpec_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "telemetric.statswrapper._stats_wrapper._SignatureSpec",
+    .tp_basicsize = sizeof(SignatureSpecObject),
+    .tp_itemsize = sizeof(argspec),
+    .tp_dealloc = (destructor)signature_spec_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)signature_spec_traverse,
+};
+
+
+static SignatureSpecObject *
+signature_spec_new(Py_ssize_t npos_only, PyObject *kwnames,
+        PyObject *const *args, Py_ssize_t total_args)
+{
+    SignatureSpecObject *spec = PyObject_GC_NewVar(
+        SignatureSpecObject, &SignatureSpec_Type, total_args + 1);
+    if (spec == NULL) {
+        return NULL;
+    }
+    spec->key = NULL;
+    spec->users = 1;
+    spec->npos_only = npos_only;
+    // Ensure we can dealloc and also NULL terminate.
+    memset(spec->args, 0, sizeof(argspec) * (total_args + 1));
+
+    for (Py_ssize_t i = 0; i < total_args; i++) {
+        if (i >= npos_only) {
+            spec->args[i].kwname = PyTuple_GET_ITEM(kwnames, i - npos_only);
+            Py_INCREF(spec->args[i].kwname);
+            /* should be interned, but lets make sure */
+            PyUnicode_InternInPlace(&spec->args[i].kwname);
+        }
+        if (args[i] == Py_None) {
+            continue;
+        }
+        /* The typical case: We have a tuple with values to check for. */
+        Py_INCREF(args[i]);
+        spec->args[i].known_params = args[i];
+        if (build_param_table(&spec->args[i]) < 0) {
+            Py_DECREF(spec);
+            return NULL;
+        }
+    }
+    PyObject_GC_Track(spec);
+    return spec;
+}
+
+
+/*
+ * Whether the tracked values of `spec` have the same types as `args` (they
+ * are equal).  Otherwise a wrapper tracking `(1, 2)` would report the values
+ * of one tracking `(True, 2.0)` or vice versa.
+ */
+static int
+signature_spec_matches(SignatureSpecObject *spec, PyObject *const *args)
+{
+    for (Py_ssize_t i = 0; i < Py_SIZE(spec) - 1; i++) {
+        PyObject *known_params = spec->args[i].known_params;
+        if (known_params == NULL || known_params == args[i]) {
+            continue;
+        }
+        for (Py_ssize_t j = 0; j < PyTuple_GET_SIZE(known_params); j++) {
+            if (Py_TYPE(PyTuple_GET_ITEM(known_params, j))
+                    != Py_TYPE(PyTuple_GET_ITEM(args[i], j))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Whether all tracked values are of builtin types (see `has_builtin_hash()`).
+ * These never reference other objects (like a class whose methods are
+ * wrapped), so an interned spec for them cannot keep a cycle alive.
+ */
+static int
+signature_spec_internable(PyObject *const *args, Py_ssize_t total_args)
+{
+    for (Py_ssize_t i = 0; i < total_args; i++) {
+        if (args[i] == Py_None) {
+            continue;
+        }
+        for (Py_ssize_t j = 0; j < PyTuple_GET_SIZE(args[i]); j++) {
+            if (!has_builtin_hash(PyTuple_GET_ITEM(args[i], j))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Release the reference of a wrapper.  The last wrapper using an interned
+ * spec removes it from `signature_specs`.
+ */
+static void
+signature_spec_release(SignatureSpecObject *spec)
+{
+    if (spec->key != NULL) {
+        PyObject *exc_type, *exc_value, *exc_tb;
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        SIGNATURE_SPECS_LOCK();
+        if (--spec->users == 0 &&
+                PyDict_DelItem(signature_specs, spec->key) < 0) {
+            PyErr_Clear();
+        }
+        SIGNATURE_SPECS_UNLOCK();
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    }
+    Py_DECREF(spec);
+}
+
+
+/*
+ * Get the (interned if possible) spec for a signature.  `args` must be None
+ * or tuples.  Specs of other than builtin tracked values are not shared.
+ */
+static SignatureSpecObject *
+signature_spec_get(Py_ssize_t npos_only, PyObject *kwnames,
+        PyObject *const *args, Py_ssize_t total_args)
+{
+    if (!signature_spec_internable(args, total_args)) {
+        return signature_spec_new(npos_only, kwnames, args, total_args);
+    }
+    PyObject *key = PyTuple_New(total_args + 2);
+    if (key == NULL) {
+        return NULL;
+    }
+    PyObject *npos_obj = PyLong_FromSsize_t(npos_only);
+    if (npos_obj == NULL) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(key, 0, npos_obj);
+    PyObject *kwnames_obj = kwnames != NULL ? kwnames : Py_None;
+    Py_INCREF(kwnames_obj);
+    PyTuple_SET_ITEM(key, 1, kwnames_obj);
+    for (Py_ssize_t i = 0; i < total_args; i++) {
+        Py_INCREF(args[i]);
+        PyTuple_SET_ITEM(key, i + 2, args[i]);
+    }
+
+    SignatureSpecObject *spec = NULL;
+    SIGNATURE_SPECS_LOCK();
+    spec = (SignatureSpecObject *)PyDict_GetItemWithError(signature_specs, key);
+    if (spec != NULL) {
+        Py_INCREF(spec);
+        spec->users++;
+    }
+    SIGNATURE_SPECS_UNLOCK();
+    if (spec != NULL) {
+        if (signature_spec_matches(spec, args)) {
+            Py_DECREF(key);
+            return spec;
+        }
+        /* Equal but not the same values, use a private spec. */
+        signature_spec_release(spec);
+        Py_CLEAR(key);
+    }
+    else if (PyErr_Occurred()) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    SignatureSpecObject *new_spec = signature_spec_new(
+        npos_only, kwnames, args, total_args);
+    if (new_spec == NULL || key == NULL) {
+        Py_XDECREF(key);
+        return new_spec;
+    }
+    /* Another thread may have created the same spec meanwhile. */
+    SIGNATURE_SPECS_LOCK();
+    spec = (SignatureSpecObject *)PyDict_SetDefault(
+        signature_specs, key, (PyObject *)new_spec);
+    if (spec == new_spec) {
+        new_spec->key = key;
+    }
+    else if (spec != NULL) {
+        Py_INCREF(spec);
+        spec->users++;
+    }
+    SIGNATURE_SPECS_UNLOCK();
+    if (spec != new_spec) {
+        Py_DECREF(key);
+        Py_DECREF(new_spec);
+    }
+    return spec;
+}
+
+
+static void
+registry_add(StatsWrapperObject *self)
+{
+    REGISTRY_LOCK();
+    self->wrapper_id = ++last_wrapper_id;
+    self->registry_prev = NULL;
+    self->registry_next = registry_head;
+    if (registry_head != NULL) {
+        registry_head->registry_prev = self;
+    }
+    registry_head = self;
+    set_vectorcall(self, select_vectorcall(self));
+    REGISTRY_UNLOCK();
+}
+
+
+/*
+ * Remove a wrapper that is being deallocated from the registry.  Returns 0
+ * if it was resurrected instead (free-threading only, a registry walk took
+ * a new reference just before the refcount dropped to zero).
+ */
+static int
+registry_remove(StatsWrapperObject *self)
+{
+    REGISTRY_LOCK();
+#ifdef Py_GIL_DISABLED
+    if (Py_REFCNT(self) > 0) {
+        REGISTRY_UNLOCK();
+        return 0;
+    }
+#endif
+    StatsWrapperObject *prev = self->registry_prev;
+    StatsWrapperObject *next = self->registry_next;
+    if (prev != NULL) {
+        prev->registry_next = next;
+    }
+    else if (registry_head == self) {
+        registry_head = next;
+    }
+    if (next != NULL) {
+        next->registry_prev = prev;
+    }
+    self->registry_prev = self->registry_next = NULL;
+    REGISTRY_UNLOCK();
+    return 1;
+}
+
+
+static struct module_totals *module_totals_get(PyObject *wrapped);
+static void module_totals_fold(StatsWrapperObject *self);
+#ifdef HAVE_MONITORING
+static PyObject *monitor_detach(StatsWrapperObject *self);
+#endif
+
+
+static void
+statswrapper_dealloc(StatsWrapperObject *self)
+{
+    if (!registry_remove(self)) {
+        return;
+    }
+    PyObject_GC_UnTrack(self);
+    PyObject *monitored_code = NULL;
+    REGISTRY_LOCK();
+#ifdef HAVE_MONITORING
+    monitored_code = monitor_detach(self);
+#endif
+    module_totals_fold(self);
+    arena_release(self);
+    REGISTRY_UNLOCK();
+    Py_XDECREF(monitored_code);
+    Py_XDECREF(self->wrapped);
+    Py_XDECREF(self->dict);
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        if (self->args[i].types != NULL) {
+            for (Py_ssize_t j = 0; j < TYPE_TABLE_SIZE; j++) {
+                Py_XDECREF(self->args[i].types[j]);
+            }
+            PyMem_Free(self->args[i].types);
+        }
+        if (self->args[i].dtypes != NULL) {
+            for (Py_ssize_t j = 0; j < DTYPE_TABLE_MAX; j++) {
+                Py_XDECREF(self->args[i].dtypes[j]);
+            }
+            PyMem_Free(self->args[i].dtypes);
+        }
+    }
+    for (int i = 0; i < KWNAMES_CACHE_SIZE; i++) {
+        if (self->kwnames_cache[i] != NULL) {
+            Py_DECREF(self->kwnames_cache[i]->kwnames);
+            PyMem_Free(self->kwnames_cache[i]);
+        }
+    }
+    Py_XDECREF(self->sketch);
+    if (self->spec != NULL) {
+        signature_spec_release(self->spec);
+    }
+    PyMem_Free(self->counters_alloc);
+    PyMem_Free(self->caller_counters_alloc);
+    PyMem_Free(self->histograms_alloc);
+    PyMem_Free(self->name);
+    PyObject_GC_Del(self);
+}
+
+
+static int
+statswrapper_traverse(StatsWrapperObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->wrapped);
+    Py_VISIT(self->dict);
+    Py_VISIT(self->spec);
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        if (self->args[i].types != NULL) {
+            for (Py_ssize_t j = 0; j < TYPE_TABLE_SIZE; j++) {
+                Py_VISIT(self->args[i].types[j]);
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Clears everything `statswrapper_traverse()` visits.  Calling the wrapper
+ * afterwards (a finalizer still might) raises ReferenceError, its stats can
+ * still be read.  The borrowed references into the spec are cleared with it.
+ */
+static int
+statswrapper_clear(StatsWrapperObject *self)
+{
+    PyObject *wrapped = self->wrapped;
+    REGISTRY_LOCK();
+    self->wrapped = NULL;
+    self->wrapped_vectorcall = NULL;
+    set_vectorcall(self, select_vectorcall(self));
+    REGISTRY_UNLOCK();
+    Py_XDECREF(wrapped);
+    Py_CLEAR(self->dict);
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        if (self->args[i].types != NULL) {
+            for (Py_ssize_t j = 0; j < TYPE_TABLE_SIZE; j++) {
+                Py_CLEAR(self->args[i].types[j]);
+            }
+        }
+    }
+    SignatureSpecObject *spec = self->spec;
+    if (spec != NULL) {
+        for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+            self->args[i].known_params = NULL;
+            self->args[i].param_table = NULL;
+            self->args[i].param_mask = 0;
+        }
+        self->spec = NULL;
+        signature_spec_release(spec);
+    }
+    return 0;
+}
+
+
+/*
+ * Only used for plain attribute access.  Method calls skip the binding (see
+ * Py_TPFLAGS_METHOD_DESCRIPTOR) and pass the instance as first argument.
+ */
+static PyObject *
+statswrapper___get__(PyObject *self, PyObject *obj, PyObject *cls)
+{
+    if (obj == NULL) {
+        /* Act like a static method, no need to bind */
+        Py_INCREF(self);
+        return self;
+    }
+    return PyMethod_New(self, obj);
+}
+
+
+/*
+ * The attributes `functools.update_wrapper` would copy are looked up on the
+ * wrapped callable unless they were set on the wrapper.  That way most
+ * wrappers never need their `__dict__`.
+ */
+static PyObject *
+statswrapper_get_forwarded(StatsWrapperObject *self, void *closure)
+{
+    const char *name = (const char *)closure;
+    PyObject *dict = self->dict;
+    if (dict != NULL) {
+#ifdef Py_GIL_DISABLED
+        PyObject *value;
+        if (PyDict_GetItemStringRef(dict, name, &value) != 0) {
+            return value;
+        }
+#else
+        PyObject *value = PyDict_GetItemString(dict, name);
+        if (value != NULL) {
+            Py_INCREF(value);
+            return value;
+        }
+#endif
+    }
+    if (self->wrapped == NULL) {
+        /* Not ReferenceError, so that `getattr()` defaults keep working */
+        PyErr_Format(PyExc_AttributeError,
+                "'%s' is not available, the wrapped callable was cleared.", name);
+        return NULL;
+    }
+    if (strcmp(name, "__wrapped__") == 0) {
+        Py_INCREF(self->wrapped);
+        return self->wrapped;
+    }
+    return PyObject_GetAttrString(self->wrapped, name);
+}
+
+
+static int
+statswrapper_set_forwarded(StatsWrapperObject *self, PyObject *value,
+        void *closure)
+{
+    const char *name = (const char *)closure;
+    PyObject *dict = PyObject_GenericGetDict((PyObject *)self, NULL);
+    if (dict == NULL) {
+        return -1;
+    }
+    int res;
+    if (value != NULL) {
+        res = PyDict_SetItemString(dict, name, value);
+    }
+    else {
+        res = PyDict_DelItemString(dict, name);
+        if (res < 0 && PyErr_ExceptionMatches(PyExc_KeyError)) {
+            PyErr_SetString(PyExc_AttributeError, name);
+        }
+    }
+    Py_DECREF(dict);
+    return res;
+}
+
+
+#define FORWARDED_ATTRIBUTE(name) \
+    {name, (getter)statswrapper_get_forwarded, \
+        (setter)statswrapper_set_forwarded, NULL, (void *)name}
+
+static struct PyGetSetDef statswrapper_getset[] = {
+    {"__dict__", &PyObject_GenericGetDict, 0, NULL, 0},
+    FORWARDED_ATTRIBUTE("__module__"),
+    FORWARDED_ATTRIBUTE("__name__"),
+    FORWARDED_ATTRIBUTE("__qualname__"),
+    FORWARDED_ATTRIBUTE("__doc__"),
+    FORWARDED_ATTRIBUTE("__annotations__"),
+    FORWARDED_ATTRIBUTE("__type_params__"),
+    FORWARDED_ATTRIBUTE("__code__"),
+    FORWARDED_ATTRIBUTE("__wrapped__"),
+    {0, 0, 0, 0, 0}
+};
+
+
+static PyMethodDef statswrapper_methods[] = {
+    {"_get_counts",
+        (PyCFunction)statswrapper__get_counts,
+        METH_NOARGS, NULL},
+    {"_get_timing",
+        (PyCFunction)statswrapper__get_timing,
+        METH_NOARGS, NULL},
+    {"_get_histogram",
+        (PyCFunction)statswrapper__get_histogram,
+        METH_NOARGS, NULL},
+    {"_get_param_stats",
+        (PyCFunction)statswrapper__get_param_stats,
+        METH_NOARGS, NULL},
+    {"_get_type_stats",
+        (PyCFunction)statswrapper__get_type_stats,
+        METH_NOARGS, NULL},
+    {"_get_callers",
+        (PyCFunction)statswrapper__get_callers,
+        METH_NOARGS, NULL},
+    {"_enable_type_stats",
+        (PyCFunction)statswrapper__enable_type_stats,
+        METH_NOARGS, NULL},
+    {"_snapshot_and_reset",
+        (PyCFunction)statswrapper__snapshot_and_reset,
+        METH_NOARGS, NULL},
+    {"_get_array_stats",
+        (PyCFunction)statswrapper__get_array_stats,
+        METH_NOARGS, NULL},
+    {"_enable_array_stats",
+        (PyCFunction)statswrapper__enable_array_stats,
+        METH_VARARGS, NULL},
+    {"_enable_cpu_time",
+        (PyCFunction)statswrapper__enable_cpu_time,
+        METH_NOARGS, NULL},
+    {"_set_sampling",
+        (PyCFunction)(void(*)(void))statswrapper__set_sampling,
+        METH_VARARGS | METH_KEYWORDS, NULL},
+    {"_enable_sketch",
+        (PyCFunction)(void(*)(void))statswrapper__enable_sketch,
+        METH_VARARGS | METH_KEYWORDS, NULL},
+    {"_get_sketch",
+        (PyCFunction)statswrapper__get_sketch,
+        METH_NOARGS, NULL},
+    {"_set_npos",
+        (PyCFunction)statswrapper__set_npos,
+        METH_O, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+
+/*
+ * Binding is just prepending the instance to the arguments (like for
+ * functions), so `obj.method(...)` can call the wrapper with `obj` as first
+ * argument instead of allocating a bound method for each call.  Calls
+ * forward PY_VECTORCALL_ARGUMENTS_OFFSET, so the wrapped function can also
+ * avoid copying the arguments.
+ */
+#ifdef Py_TPFLAGS_METHOD_DESCRIPTOR
+#define STATSWRAPPER_METHOD_DESCRIPTOR Py_TPFLAGS_METHOD_DESCRIPTOR
+#else
+#define STATSWRAPPER_METHOD_DESCRIPTOR 0
+#endif
+
+static PyTypeObject StatsWrapper_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "telemetric.statswrapper._stats_wrapper._StatsWrapper",
+    .tp_basicsize = sizeof(StatsWrapperObject),
+    .tp_itemsize = sizeof(arginfo),
+    .tp_dealloc = (destructor)statswrapper_dealloc,
+    .tp_flags = (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL
+                 | Py_TPFLAGS_HAVE_GC | STATSWRAPPER_METHOD_DESCRIPTOR),
+    .tp_traverse = (traverseproc)statswrapper_traverse,
+    .tp_clear = (inquiry)statswrapper_clear,
+    .tp_call = &PyVectorcall_Call,
+    .tp_vectorcall_offset = offsetof(StatsWrapperObject, vectorcall),
+    .tp_dictoffset = offsetof(StatsWrapperObject, dict),
+    .tp_descr_get = statswrapper___get__,
+    .tp_getset = statswrapper_getset,
+    .tp_methods = statswrapper_methods,
+};
+
+
+/*
+ * Assign the counter slots for all arguments and allocate (zeroed) counter
+ * blocks for all shards.  If counters were already allocated (the layout
+ * changed), the sampling settings are preserved.
+ */
+static int
+allocate_counters(StatsWrapperObject *self)
+{
+    Py_ssize_t nslots = 0;
+    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
+        arginfo *info = &self->args[i];
+        info->count_slot = nslots++;
+        info->param_slots = nslots;
+        if (info->known_params != NULL) {
+            nslots += PyTuple_GET_SIZE(info->known_params);
+        }
+        info->type_slots = nslots;
+        if (info->types != NULL) {
+            nslots += TYPE_TABLE_SIZE + 1;
+        }
+        info->array_slots = nslots;
+        if (info->dtypes != NULL) {
+            nslots += ARRAY_SLOTS;
+        }
+    }
+    if (self->cpu_slots >= 0) {
+        self->cpu_slots = nslots;
+        nslots += CPU_SLOTS;
+    }
+    Py_ssize_t stride = sizeof(statscounters) + nslots * sizeof(int64_t);
+    stride = (stride + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+    REGISTRY_LOCK();
+    char *counters = arena_allocate(self, stride);
+    REGISTRY_UNLOCK();
+    void *counters_alloc = NULL;
+    if (counters == NULL) {
+        counters_alloc = PyMem_Calloc(1, COUNTER_SHARDS * stride + CACHE_LINE);
+        if (counters_alloc == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        counters = cache_line_align(counters_alloc);
+    }
+    Py_ssize_t sample_interval = 1;
+    Py_ssize_t sample_countdown = 1;
+    if (self->counters != NULL) {
+        sample_interval = get_shard(self, 0)->sample_interval;
+        sample_countdown = get_shard(self, 0)->sample_countdown;
+        PyMem_Free(self->counters_alloc);
+    }
+    self->counters_alloc = counters_alloc;
+    self->counters = counters;
+    self->counters_stride = stride;
+    for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+        statscounters *counters = get_shard(self, shard);
+        counters->min_time = INT64_MAX;
+        counters->sample_interval = sample_interval;
+        counters->sample_countdown = sample_countdown;
+    }
+    return 0;
+}
+
+
+/*
+ * Whether calls of `func` return a generator, coroutine or async generator
+ * (only for Python functions, anything else is timed like a plain call).
+ * Generator based coroutines (`types.coroutine`) are not proxied, since
+ * `await` only accepts the generator itself.
+ */
+static int
+generator_kind(PyObject *func)
+{
+    if (!PyFunction_Check(func)) {
+        return GEN_NONE;
+    }
+    PyObject *flags_obj = PyObject_GetAttrString(
+            PyFunction_GET_CODE(func), "co_flags");
+    if (flags_obj == NULL) {
+        PyErr_Clear();
+        return GEN_NONE;
+    }
+    long flags = PyLong_AsLong(flags_obj);
+    Py_DECREF(flags_obj);
+    if (flags == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        return GEN_NONE;
+    }
+    if (flags & CO_ITERABLE_COROUTINE) {
+        return GEN_NONE;
+    }
+    if (flags & CO_COROUTINE) {
+        return GEN_COROUTINE;
+    }
+    if (flags & CO_ASYNC_GENERATOR) {
+        return GEN_ASYNC_GENERATOR;
+    }
+    if (flags & CO_GENERATOR) {
+        return GEN_GENERATOR;
+    }
+    return GEN_NONE;
+}
+
+
+/*
+ * Factory for the StatsWrapper object creation.
+ */
+static PyObject *
+stats_wrapper_create(PyObject *mod,
+        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(len_args);
+    if (nargs < 1) {
+        PyErr_SetString(PyExc_TypeError, "Must pass at least one callable.");
+        return NULL;
+    }
+    /* Store the wrapped one, and treat all other arguments as generic args */
+    PyObject *wrapped = args[0];
+    args++;
+    nargs--;
+
+    Py_ssize_t total_args = nargs;
+    if (kwnames != NULL) {
+        total_args += PyTuple_GET_SIZE(kwnames);
+    }
+    for (Py_ssize_t i = 0; i < total_args; i++) {
+        if (args[i] != Py_None && !PyTuple_Check(args[i])) {
+            PyErr_SetString(PyExc_TypeError,
+                "All arguments must be None, or tuples.");
+            return NULL;
+        }
+    }
+    SignatureSpecObject *spec = signature_spec_get(
+        nargs, kwnames, args, total_args);
+    if (spec == NULL) {
+        return NULL;
+    }
+    struct module_totals *totals = module_totals_get(wrapped);
+    if (totals == NULL) {
+        signature_spec_release(spec);
+        return NULL;
+    }
+    StatsWrapperObject *statswrapper = (StatsWrapperObject *)PyObject_GC_NewVar(
+        StatsWrapperObject, &StatsWrapper_Type, total_args + 1);
+    if (statswrapper == NULL) {
+        signature_spec_release(spec);
+        return NULL;
+    }
+    statswrapper->spec = spec;
+    statswrapper->module_totals = totals;
+
+    statswrapper->vectorcall = (vectorcallfunc)statswrapper_vectorcall;
+    statswrapper->monitored_code = NULL;
+    statswrapper->gen_kind = generator_kind(wrapped);
+    statswrapper->cpu_slots = -1;
+    statswrapper->arena_entry = -1;
+    statswrapper->reset_calls = 0;
+    statswrapper->wrapper_id = 0;
+    memset(statswrapper->callers, 0, sizeof(statswrapper->callers));
+    statswrapper->n_callers = 0;
+    statswrapper->caller_counters_alloc = NULL;
+    statswrapper->histograms = NULL;
+    statswrapper->histograms_alloc = NULL;
+    statswrapper->registry_prev = statswrapper->registry_next = NULL;
+    statswrapper->npos_only = nargs;
+    // Allow setting the number of positional args (i.e. enforce kwarg only).
+    statswrapper->npos = total_args;
+    statswrapper->max_sample_rate = 0;
+    statswrapper->sketch = NULL;
+    memset(statswrapper->kwnames_cache, 0, sizeof(statswrapper->kwnames_cache));
+    statswrapper->counters = NULL;
+    statswrapper->counters_alloc = NULL;
+    statswrapper->name = NULL;
+    // Ensure we can dealloc and also NULL terminate.
+    memset(statswrapper->args, 0, sizeof(arginfo) * (total_args + 1));
+    for (Py_ssize_t i = 0; i < total_args; i++) {
+        statswrapper->args[i].known_params = spec->args[i].known_params;
+        statswrapper->args[i].param_table = spec->args[i].param_table;
+        statswrapper->args[i].param_mask = spec->args[i].param_mask;
+    }
+
+    Py_INCREF(wrapped);
+    statswrapper->wrapped = wrapped;
+    statswrapper->wrapped_vectorcall = NULL;
+    if (PyFunction_Check(wrapped) || PyCFunction_Check(wrapped)) {
+        statswrapper->wrapped_vectorcall = PyVectorcall_Function(wrapped);
+    }
+    /* Only created when an attribute is set (see `statswrapper_getset`) */
+    statswrapper->dict = NULL;
+
+    statswrapper->name = wrapper_name(wrapped);
+    if (statswrapper->name == NULL || allocate_counters(statswrapper) < 0) {
+        Py_DECREF(statswrapper);
+        return NULL;
+    }
+    registry_add(statswrapper);
+    PyObject_GC_Track(statswrapper);
+
+    return (PyObject *)statswrapper;
+}
+
+
+/*
+ * Switch all live wrappers between gathering stats and only forwarding
+ * the call.  New wrappers follow the current setting.
+ */
+static PyObject *
+set_stats_enabled(int enabled)
+{
+    REGISTRY_LOCK();
+    stats_enabled = enabled;
+    for (StatsWrapperObject *w = registry_head; w != NULL;
+            w = w->registry_next) {
+        set_vectorcall(w, select_vectorcall(w));
+    }
+    REGISTRY_UNLOCK();
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+module_disable(PyObject *mod, PyObject *unused)
+{
+    return set_stats_enabled(0);
+}
+
+
+static PyObject *
+module_enable(PyObject *mod, PyObject *unused)
+{
+    return set_stats_enabled(1);
+}
+
+
+static PyObject *
+module_is_enabled(PyObject *mod, PyObject *unused)
+{
+    return PyBool_FromLong(stats_enabled);
+}
+
+
+/*
+ * A snapshot of the main counters of all wrappers, stored column-wise as
+ * int64 so that many wrappers can be processed without a Python call each.
+ * Exposes the buffer protocol as a read-only 2-D (column, wrapper) array,
+ * `wrappers` gives the wrapper for each row.
+ */
+#define SNAPSHOT_COLUMNS 11
+static const char *snapshot_columns[SNAPSHOT_COLUMNS] = {
+    "calls", "errors", "invalid", "timed",
+    "total_ns", "est_total_ns", "min_ns", "max_ns",
+    "est_self_ns", "est_outer_ns", "est_wall_ns"
+};
+#define SNAPSHOT_TIMED 3
+#define SNAPSHOT_MIN_NS 6
+#define SNAPSHOT_MAX_NS 7
+
 typedef struct {
     PyObject_VAR_HEAD
-    vectorcallfunc vectorcall;
-    PyObject *wrapped;
-    PyObject *dict;
-    Py_ssize_t total_calls;
-    Py_ssize_t invalid_args;
-    Py_ssize_t error_results;
-    double total_time;
-    double min_time;
-    double max_time;
-    Py_ssize_t npos;
-    Py_ssize_t npos_only;
-    arginfo args[];  // NULL terminated arguments (one more with no kwname).
-} StatsWrapperObject;
+    PyObject *wrappers;  // tuple
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+    int64_t data[];  // SNAPSHOT_COLUMNS rows of len(wrappers) items
+} StatsSnapshotObject;
+
+static PyTypeObject StatsSnapshot_Type;
 
 
-static PyObject *perf_counter_func = NULL;
+/* The `snapshot_columns` of `self` (summed over the shards) */
+static void
+wrapper_totals(StatsWrapperObject *self, int64_t *values)
+{
+    int64_t calls = 0, errors = 0, invalid = 0, timed = 0;
+    int64_t total = 0, est_total = 0, min_time = INT64_MAX, max_time = 0;
+    int64_t est_self = 0, est_outer = 0, est_wall = 0;
+    for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+        statscounters *c = get_shard(self, shard);
+        calls += COUNTER_LOAD(c->total_calls);
+        errors += COUNTER_LOAD(c->error_results);
+        invalid += COUNTER_LOAD(c->invalid_args);
+        timed += COUNTER_LOAD(c->timed_calls);
+        total += COUNTER_LOAD64(c->total_time);
+        est_total += COUNTER_LOAD64(c->est_total_time);
+        est_self += COUNTER_LOAD64(c->est_self_time);
+        est_outer += COUNTER_LOAD64(c->est_outer_time);
+        est_wall += COUNTER_LOAD64(c->est_wall_time);
+        int64_t shard_min = COUNTER_LOAD64(c->min_time);
+        int64_t shard_max = COUNTER_LOAD64(c->max_time);
+        min_time = shard_min < min_time ? shard_min : min_time;
+        max_time = shard_max > max_time ? shard_max : max_time;
+    }
+    int64_t totals[SNAPSHOT_COLUMNS] = {
+        calls, errors, invalid, timed, total, est_total,
+        timed > 0 ? min_time : 0, max_time, est_self, est_outer,
+        est_wall
+    };
+    memcpy(values, totals, sizeof(totals));
+}
 
 
-static inline int
-handle_arg_stats(arginfo *arginfo, PyObject *arg)
+/* Store the counters of `self` in column `i` of `snapshot` */
+static void
+snapshot_store(StatsSnapshotObject *snapshot, Py_ssize_t i, StatsWrapperObject *self)
+{
+    int64_t values[SNAPSHOT_COLUMNS];
+    wrapper_totals(self, values);
+    Py_ssize_t n = snapshot->shape[1];
+    for (int col = 0; col < SNAPSHOT_COLUMNS; col++) {
+        snapshot->data[col * n + i] = values[col];
+    }
+}
+
+
+/*
+ * The counts of deallocated wrappers summed per module of the wrapped
+ * callable, so that wrappers of e.g. closures can come and go without
+ * losing their stats.  There is one entry for each module (or None), they
+ * are never freed.
+ */
+typedef struct module_totals {
+    struct module_totals *next;
+    PyObject *module;  // str or None
+    int64_t wrappers;
+    int64_t values[SNAPSHOT_COLUMNS];
+} module_totals;
+
+static module_totals *module_totals_head = NULL;
+
+
+static int
+module_totals_matches(module_totals *totals, PyObject *module)
 {
-    arginfo->count++;
+    if (totals->module == module) {
+        return 1;
+    }
+    return (module != Py_None && totals->module != Py_None &&
+            PyUnicode_Compare(totals->module, module) == 0);
+}
 
-    if (arginfo->known_params != NULL) {
-        Py_ssize_t n_params = PyTuple_GET_SIZE(arginfo->known_params);
-        Py_ssize_t idx = 0;
-        for (; idx < n_params; idx++) {
-            if (PyTuple_GET_ITEM(arginfo->known_params, idx) == arg) {
-                break;
-            }
+
+/* Find or add the entry for the module of `wrapped` */
+static module_totals *
+module_totals_get(PyObject *wrapped)
+{
+    PyObject *module = PyObject_GetAttrString(wrapped, "__module__");
+    if (module == NULL || !PyUnicode_CheckExact(module)) {
+        if (module == NULL && is_critical_error()) {
+            return NULL;
         }
-        if (idx == n_params) {
-            idx = 0;
-            for (; idx < n_params; idx++) {
-                int eq = PyObject_RichCompareBool(
-                    PyTuple_GET_ITEM(arginfo->known_params, idx), arg, Py_EQ);
+        PyErr_Clear();
+        Py_XDECREF(module);
+        module = Py_None;
+        Py_INCREF(module);
+    }
+    /* Allocate up front, no allocations under the registry lock */
+    module_totals *new_totals = PyMem_Calloc(1, sizeof(module_totals));
+    if (new_totals == NULL) {
+        Py_DECREF(module);
+        PyErr_NoMemory();
+        return NULL;
+    }
 
-                if (eq < 0) {
-                    if (PyErr_ExceptionMatches(PyExc_RecursionError) ||
-                            PyErr_ExceptionMatches(PyExc_MemoryError) ||
-                            PyErr_ExceptionMatches(PyExc_KeyboardInterrupt)) {
-                        return -1;
-                    }
-                    // Just ignore all but the most critical errors here...
-                    PyErr_Clear();
-                }
-                if (eq) {
-                    break;
-                }
+    REGISTRY_LOCK();
+    module_totals *totals = module_totals_head;
+    while (totals != NULL && !module_totals_matches(totals, module)) {
+        totals = totals->next;
+    }
+    if (totals == NULL) {
+        totals = new_totals;
+        totals->module = module;
+        totals->next = module_totals_head;
+        module_totals_head = totals;
+        new_totals = NULL;
+        module = NULL;
+    }
+    REGISTRY_UNLOCK();
+    PyMem_Free(new_totals);
+    Py_XDECREF(module);
+    return totals;
+}
+
+
+/* Add the counts of a wrapper that is deallocated, with the registry locked */
+static void
+module_totals_fold(StatsWrapperObject *self)
+{
+    if (self->counters == NULL) {
+        return;  // creation failed
+    }
+    module_totals *totals = self->module_totals;
+    int64_t values[SNAPSHOT_COLUMNS];
+    wrapper_totals(self, values);
+    int64_t *sum = totals->values;
+    if (values[SNAPSHOT_TIMED] > 0 && (sum[SNAPSHOT_TIMED] == 0 ||
+            values[SNAPSHOT_MIN_NS] < sum[SNAPSHOT_MIN_NS])) {
+        sum[SNAPSHOT_MIN_NS] = values[SNAPSHOT_MIN_NS];
+    }
+    if (values[SNAPSHOT_MAX_NS] > sum[SNAPSHOT_MAX_NS]) {
+        sum[SNAPSHOT_MAX_NS] = values[SNAPSHOT_MAX_NS];
+    }
+    for (int col = 0; col < SNAPSHOT_COLUMNS; col++) {
+        if (col != SNAPSHOT_MIN_NS && col != SNAPSHOT_MAX_NS) {
+            sum[col] += values[col];
+        }
+    }
+    totals->wrappers++;
+}
+
+
+static PyObject *
+module_collected_stats(PyObject *mod, PyObject *unused)
+{
+    PyObject *res = PyDict_New();
+    if (res == NULL) {
+        return NULL;
+    }
+    /* Entries are only ever added at the head and never change otherwise */
+    REGISTRY_LOCK();
+    module_totals *totals = module_totals_head;
+    REGISTRY_UNLOCK();
+    for (; totals != NULL; totals = totals->next) {
+        int64_t values[SNAPSHOT_COLUMNS];
+        REGISTRY_LOCK();
+        int64_t wrappers = totals->wrappers;
+        memcpy(values, totals->values, sizeof(values));
+        REGISTRY_UNLOCK();
+        if (wrappers == 0) {
+            continue;
+        }
+
+        PyObject *stats = Py_BuildValue("{sL}", "wrappers", (long long)wrappers);
+        if (stats == NULL) {
+            goto error;
+        }
+        for (int col = 0; col < SNAPSHOT_COLUMNS; col++) {
+            PyObject *value = PyLong_FromLongLong(values[col]);
+            if (value == NULL ||
+                    PyDict_SetItemString(stats, snapshot_columns[col], value) < 0) {
+                Py_XDECREF(value);
+                Py_DECREF(stats);
+                goto error;
             }
+            Py_DECREF(value);
         }
-        if (idx != n_params) {
-            arginfo->param_counts[idx]++;
+        int err = PyDict_SetItem(res, totals->module, stats);
+        Py_DECREF(stats);
+        if (err < 0) {
+            goto error;
         }
     }
-    return 0;
+    return res;
+
+  error:
+    Py_DECREF(res);
+    return NULL;
 }
 
 
 static PyObject *
-statswrapper_vectorcall(StatsWrapperObject *self,
-        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+module_snapshot_all(PyObject *mod, PyObject *unused)
 {
-    int invalid_args = 0;
-    Py_ssize_t nargs = PyVectorcall_NARGS(len_args);
-
-    /* Make sure we don't crash on bad args (or incorrect setup) */
-    Py_ssize_t nargs_valid = nargs;
-    if (nargs > self->npos) {
-        invalid_args = 1;
-        nargs_valid = self->npos;
+    /*
+     * Allocations can run the GC (and deallocate wrappers), so allocate
+     * first and fill in without allocating, retry if more wrappers appeared.
+     */
+    Py_ssize_t n = 0;
+    REGISTRY_LOCK();
+    for (StatsWrapperObject *w = registry_head; w != NULL; w = w->registry_next) {
+        n++;
     }
+    REGISTRY_UNLOCK();
 
-    for (Py_ssize_t i = 0; i < nargs_valid; i++) {
-        if (handle_arg_stats(&self->args[i], args[i]) < 0) {
+    while (1) {
+        StatsSnapshotObject *snapshot = PyObject_GC_NewVar(
+                StatsSnapshotObject, &StatsSnapshot_Type, SNAPSHOT_COLUMNS * n);
+        if (snapshot == NULL) {
+            return NULL;
+        }
+        snapshot->wrappers = PyTuple_New(n);
+        if (snapshot->wrappers == NULL) {
+            Py_SET_SIZE(snapshot, 0);
+            Py_DECREF(snapshot);
             return NULL;
         }
+        snapshot->shape[0] = SNAPSHOT_COLUMNS;
+        snapshot->shape[1] = n;
+        snapshot->strides[0] = n * sizeof(int64_t);
+        snapshot->strides[1] = sizeof(int64_t);
+
+        Py_ssize_t i = 0;
+        int too_small = 0;
+        REGISTRY_LOCK();
+        for (StatsWrapperObject *w = registry_head; w != NULL; w = w->registry_next) {
+            if (i == n) {
+                too_small = 1;
+                break;
+            }
+            if (Py_REFCNT(w) == 0) {
+                continue;  /* being deallocated (by another thread) */
+            }
+            Py_INCREF(w);
+            PyTuple_SET_ITEM(snapshot->wrappers, i, (PyObject *)w);
+            snapshot_store(snapshot, i, w);
+            i++;
+        }
+        REGISTRY_UNLOCK();
+        if (too_small) {
+            Py_DECREF(snapshot);
+            n = 2 * n + 1;  /* n may have been 0 */
+            continue;
+        }
+        if (i < n) {
+            /* Some wrappers were deallocated meanwhile, shrink the rows. */
+            for (int col = 1; col < SNAPSHOT_COLUMNS; col++) {
+                memmove(&snapshot->data[col * i], &snapshot->data[col * n],
+                        i * sizeof(int64_t));
+            }
+            PyObject *wrappers = PyTuple_GetSlice(snapshot->wrappers, 0, i);
+            if (wrappers == NULL) {
+                Py_DECREF(snapshot);
+                return NULL;
+            }
+            Py_SETREF(snapshot->wrappers, wrappers);
+            Py_SET_SIZE(snapshot, SNAPSHOT_COLUMNS * i);
+            snapshot->shape[1] = i;
+            snapshot->strides[0] = i * sizeof(int64_t);
+        }
+        PyObject_GC_Track(snapshot);
+        return (PyObject *)snapshot;
     }
+}
 
-    Py_ssize_t nkwargs = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
-    for (Py_ssize_t i = 0; i < nkwargs; i++) {
-        PyObject *kwname = PyTuple_GET_ITEM(kwnames, i);
-        PyObject *arg = args[nargs + i];
-
-        arginfo *curr_arginfo = self->args + self->npos_only;
-        // Fast identity check, should always work out if the user told us all
-        // possible kwargs.
-        while (curr_arginfo->kwname != NULL) {
-            if (curr_arginfo->kwname != kwname) {
-                curr_arginfo++;
+
+static int
+compare_ids(const void *a, const void *b)
+{
+    uint64_t id_a = *(const uint64_t *)a;
+    uint64_t id_b = *(const uint64_t *)b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+
+/*
+ * Index the `n` wrappers and the callers their `taken` counters refer to.
+ * These callers were usually called since the last reset as well (so are
+ * among the wrappers), the registry is only walked for the others.
+ */
+static int
+wrapper_index_build_callers(wrapper_index *index, StatsWrapperObject **wrappers,
+        snapshot_taken *taken, Py_ssize_t n)
+{
+    index->n = 0;
+    index->wrappers = PyMem_Calloc(n + 1, sizeof(StatsWrapperObject *));
+    uint64_t *missing = PyMem_Calloc(n * CALLER_TABLE_SIZE + 1, sizeof(uint64_t));
+    if (index->wrappers == NULL || missing == NULL) {
+        PyMem_Free(missing);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        Py_INCREF(wrappers[i]);
+        index->wrappers[index->n++] = wrappers[i];
+    }
+    qsort(index->wrappers, index->n, sizeof(StatsWrapperObject *),
+          compare_wrapper_ids);
+
+    Py_ssize_t n_missing = 0;
+    for (Py_ssize_t i = 0; i < n; i++) {
+        for (Py_ssize_t j = 0; j < CALLER_TABLE_SIZE; j++) {
+            if (taken[i].callers.calls[j] == 0 && taken[i].callers.time[j] == 0) {
                 continue;
             }
-            break;
+#ifdef Py_GIL_DISABLED
+            uint64_t id = _Py_atomic_load_uint64_relaxed(&wrappers[i]->callers[j]);
+#else
+            uint64_t id = wrappers[i]->callers[j];
+#endif
+            if (id != 0 && wrapper_index_find(index, id) == NULL) {
+                missing[n_missing++] = id;
+            }
         }
-        if (curr_arginfo->kwname == NULL) {
-            /* The fast path didn't work out (UNLIKELY may make sense here) */
-            curr_arginfo = self->args + self->npos_only;
-            while (curr_arginfo->kwname != NULL) {
-                int eq = PyObject_RichCompareBool(curr_arginfo->kwname, kwname, Py_EQ);
-                if (eq < 0) {
-                    /* Should never happen, so error out right here */
-                    return NULL;
-                }
-                if (eq) {
-                    break;
-                }
-                curr_arginfo++;
+    }
+    if (n_missing == 0) {
+        PyMem_Free(missing);
+        return 0;
+    }
+    qsort(missing, n_missing, sizeof(uint64_t), compare_ids);
+    StatsWrapperObject **grown = PyMem_Realloc(
+            index->wrappers, (n + n_missing) * sizeof(StatsWrapperObject *));
+    if (grown == NULL) {
+        PyMem_Free(missing);
+        PyErr_NoMemory();
+        return -1;
+    }
+    index->wrappers = grown;
+    REGISTRY_LOCK();
+    for (StatsWrapperObject *w = registry_head;
+            w != NULL && index->n < n + n_missing; w = w->registry_next) {
+        if (Py_REFCNT(w) == 0) {
+            continue;  /* being deallocated (free-threading) */
+        }
+        uint64_t id = w->wrapper_id;
+        if (bsearch(&id, missing, n_missing, sizeof(uint64_t), compare_ids) != NULL &&
+                wrapper_index_find(index, id) == NULL) {
+            Py_INCREF(w);
+            index->wrappers[index->n++] = w;
+        }
+    }
+    REGISTRY_UNLOCK();
+    PyMem_Free(missing);
+    qsort(index->wrappers, index->n, sizeof(StatsWrapperObject *),
+          compare_wrapper_ids);
+    return 0;
+}
+
+
+/*
+ * `_snapshot_and_reset()` for all wrappers that were called since the last
+ * reset, so that the cost is proportional to the activity.  Returns a list
+ * of (wrapper, stats) tuples.  The counters of all of them are taken before
+ * any is reported, so that they can all be put back on errors.
+ */
+static PyObject *
+module_snapshot_and_reset_all(PyObject *mod, PyObject *unused)
+{
+    /* Collect the active wrappers first (without allocating under the lock) */
+    Py_ssize_t n = 0;
+    REGISTRY_LOCK();
+    for (StatsWrapperObject *w = registry_head; w != NULL; w = w->registry_next) {
+        for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+            if (COUNTER_LOAD(get_shard(w, shard)->total_calls) != 0) {
+                n++;
+                break;
             }
         }
-        /* If kwname is still NULL, we are not tracking it! */
-        if (curr_arginfo->kwname != NULL) {
-            if (handle_arg_stats(curr_arginfo, arg) < 0) {
-                return NULL;
+    }
+    REGISTRY_UNLOCK();
+    if (n == 0) {
+        return PyList_New(0);
+    }
+
+    StatsWrapperObject **active = PyMem_Calloc(n, sizeof(StatsWrapperObject *));
+    if (active == NULL) {
+        return PyErr_NoMemory();
+    }
+    Py_ssize_t n_active = 0;
+    REGISTRY_LOCK();
+    for (StatsWrapperObject *w = registry_head;
+            w != NULL && n_active < n; w = w->registry_next) {
+        if (Py_REFCNT(w) == 0) {
+            continue;  /* being deallocated (by another thread) */
+        }
+        for (Py_ssize_t shard = 0; shard < COUNTER_SHARDS; shard++) {
+            if (COUNTER_LOAD(get_shard(w, shard)->total_calls) != 0) {
+                Py_INCREF(w);
+                active[n_active++] = w;
+                break;
             }
         }
-        else {
-            invalid_args = 1;
+    }
+    REGISTRY_UNLOCK();
+    /* Wrappers that became active meanwhile are included in the next one */
+
+    wrapper_index index = {0, NULL};
+    PyObject *res = NULL;
+    Py_ssize_t n_taken = 0;
+    snapshot_taken *taken = PyMem_Calloc(n_active + 1, sizeof(snapshot_taken));
+    if (taken == NULL) {
+        PyErr_NoMemory();
+        goto finish;
+    }
+    while (n_taken < n_active &&
+            snapshot_take(active[n_taken], &taken[n_taken]) == 0) {
+        n_taken++;
+    }
+    if (n_taken == n_active &&
+            wrapper_index_build_callers(&index, active, taken, n_active) == 0) {
+        res = PyList_New(n_active);
+        for (Py_ssize_t i = 0; i < n_active && res != NULL; i++) {
+            PyObject *stats = snapshot_to_dict(active[i], &taken[i], &index);
+            PyObject *item = stats ? Py_BuildValue("ON", active[i], stats) : NULL;
+            if (item == NULL) {
+                Py_CLEAR(res);
+                break;
+            }
+            PyList_SET_ITEM(res, i, item);
+        }
+    }
+    if (res == NULL) {
+        for (Py_ssize_t i = 0; i < n_taken; i++) {
+            snapshot_restore(active[i], &taken[i]);
+        }
+    }
+
+  finish:
+    for (Py_ssize_t i = 0; i < n_taken; i++) {
+        snapshot_taken_clear(&taken[i]);
+    }
+    PyMem_Free(taken);
+    wrapper_index_clear(&index);
+    for (Py_ssize_t i = 0; i < n_active; i++) {
+        Py_DECREF(active[i]);
+    }
+    PyMem_Free(active);
+    return res;
+}
+
+
+static int
+snapshot_getbuffer(StatsSnapshotObject *self, Py_buffer *view, int flags)
+{
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "StatsSnapshot is read-only.");
+        return -1;
+    }
+    Py_INCREF(self);
+    view->obj = (PyObject *)self;
+    view->buf = self->data;
+    view->len = Py_SIZE(self) * sizeof(int64_t);
+    view->readonly = 1;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    if (!(flags & PyBUF_FORMAT)) {
+        /* Without a format, consumers assume unsigned bytes ("B") */
+        view->itemsize = 1;
+        view->format = NULL;
+        view->ndim = 1;
+        view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &view->len : NULL;
+        view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES
+                        ? &view->itemsize : NULL;
+        return 0;
+    }
+    view->itemsize = sizeof(int64_t);
+    view->format = "q";
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    if (view->shape == NULL) {
+        view->ndim = 1;
+    }
+    return 0;
+}
+
+
+static PyBufferProcs snapshot_as_buffer = {
+    .bf_getbuffer = (getbufferproc)snapshot_getbuffer,
+};
+
+
+static Py_ssize_t
+snapshot_length(StatsSnapshotObject *self)
+{
+    return self->shape[1];
+}
+
+
+static PySequenceMethods snapshot_as_sequence = {
+    .sq_length = (lenfunc)snapshot_length,
+};
+
+
+/*
+ * Return a (zero-copy) int64 memoryview of one column.
+ */
+static PyObject *
+snapshot_column(StatsSnapshotObject *self, PyObject *name)
+{
+    int col = 0;
+    const char *name_str = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+    if (name_str == NULL) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "column name must be a str.");
         }
+        return NULL;
     }
-
-    self->total_calls++;
-    self->invalid_args = self->invalid_args + invalid_args;
-
-    /* Get start time */
-    PyObject *start_time_obj = PyObject_CallNoArgs(perf_counter_func);
-    if (start_time_obj == NULL) {
+    while (col < SNAPSHOT_COLUMNS && strcmp(snapshot_columns[col], name_str) != 0) {
+        col++;
+    }
+    if (col == SNAPSHOT_COLUMNS) {
+        PyErr_Format(PyExc_KeyError, "%R", name);
         return NULL;
     }
-    double start_time = PyFloat_AsDouble(start_time_obj);
-    Py_DECREF(start_time_obj);
-    if (start_time == -1.0 && PyErr_Occurred()) {
+    Py_ssize_t n = self->shape[1];
+    /* memoryview cannot cast empty multi-dimensional views */
+    PyObject *view = n == 0 ? PyMemoryView_FromMemory("", 0, PyBUF_READ)
+                            : PyMemoryView_FromObject((PyObject *)self);
+    if (view == NULL) {
         return NULL;
     }
-
-    /* Call the wrapped function */
-    PyObject *res = PyObject_Vectorcall(self->wrapped, args, len_args, kwnames);
-
-    /* Get end time */
-    PyObject *end_time_obj = PyObject_CallNoArgs(perf_counter_func);
-    if (end_time_obj == NULL) {
-        Py_XDECREF(res);
+    PyObject *flat = PyObject_CallMethod(view, "cast", "s", "B");
+    Py_DECREF(view);
+    if (flat == NULL) {
         return NULL;
     }
-    double end_time = PyFloat_AsDouble(end_time_obj);
-    Py_DECREF(end_time_obj);
-    if (end_time == -1.0 && PyErr_Occurred()) {
-        Py_XDECREF(res);
+    PyObject *items = PyObject_CallMethod(flat, "cast", "s", "q");
+    Py_DECREF(flat);
+    if (items == NULL) {
         return NULL;
     }
+    PyObject *res = PySequence_GetSlice(items, col * n, (col + 1) * n);
+    Py_DECREF(items);
+    return res;
+}
 
-    /* Update timing stats */
-    double elapsed = end_time - start_time;
-    self->total_time += elapsed;
-    if (self->total_calls == 1) {
-        self->min_time = elapsed;
-        self->max_time = elapsed;
-    } else {
-        if (elapsed < self->min_time) {
-            self->min_time = elapsed;
-        }
-        if (elapsed > self->max_time) {
-            self->max_time = elapsed;
-        }
-    }
 
+static PyObject *
+snapshot_get_columns(StatsSnapshotObject *self, void *unused)
+{
+    PyObject *res = PyTuple_New(SNAPSHOT_COLUMNS);
     if (res == NULL) {
-        self->error_results++;
+        return NULL;
+    }
+    for (int col = 0; col < SNAPSHOT_COLUMNS; col++) {
+        PyObject *name = PyUnicode_FromString(snapshot_columns[col]);
+        if (name == NULL) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(res, col, name);
     }
     return res;
 }
 
 
-static PyObject *
-statswrapper__get_counts(StatsWrapperObject *self, PyObject *unused)
+static int
+snapshot_traverse(StatsSnapshotObject *self, visitproc visit, void *arg)
 {
-    return Py_BuildValue("nnn", self->total_calls, self->error_results, self->invalid_args);
+    Py_VISIT(self->wrappers);
+    return 0;
 }
 
 
-static PyObject *
-statswrapper__get_timing(StatsWrapperObject *self, PyObject *unused)
+static int
+snapshot_clear(StatsSnapshotObject *self)
 {
-    double avg_time = 0.0;
-    if (self->total_calls > 0) {
-        avg_time = self->total_time / self->total_calls;
-    }
-    return Py_BuildValue("{s:d,s:d,s:d,s:d}",
-        "total", self->total_time,
-        "average", avg_time,
-        "min", self->min_time,
-        "max", self->max_time);
+    Py_CLEAR(self->wrappers);
+    return 0;
+}
+
+
+static void
+snapshot_dealloc(StatsSnapshotObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->wrappers);
+    PyObject_GC_Del(self);
 }
 
 
+static struct PyMethodDef snapshot_methods[] = {
+    {"column", (PyCFunction)snapshot_column, METH_O,
+        "Return one column as int64 memoryview (without copying)."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyGetSetDef snapshot_getset[] = {
+    {"columns", (getter)snapshot_get_columns, 0,
+        "The names of the columns (rows of the 2-D buffer).", 0},
+    {0, 0, 0, 0, 0}
+};
+
+static struct PyMemberDef snapshot_members[] = {
+    {"wrappers", T_OBJECT, offsetof(StatsSnapshotObject, wrappers), READONLY,
+        "The wrapper belonging to each entry of the columns."},
+    {NULL, 0, 0, 0, NULL}
+};
+
+static PyTypeObject StatsSnapshot_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "telemetric.statswrapper._stats_wrapper.StatsSnapshot",
+    .tp_basicsize = sizeof(StatsSnapshotObject),
+    .tp_itemsize = sizeof(int64_t),
+    .tp_dealloc = (destructor)snapshot_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)snapshot_traverse,
+    .tp_clear = (inquiry)snapshot_clear,
+    .tp_as_buffer = &snapshot_as_buffer,
+    .tp_as_sequence = &snapshot_as_sequence,
+    .tp_methods = snapshot_methods,
+    .tp_getset = snapshot_getset,
+    .tp_members = snapshot_members,
+};
+
+
+/*
+ * Start using `buffer` (writable, e.g. a shared mmap) as counter arena and
+ * move the counters of all existing wrappers into it.  `pid` is only stored
+ * in the header for readers.  The buffer is kept
+ * alive forever.
+ */
 static PyObject *
-statswrapper__get_param_stats(StatsWrapperObject *self, PyObject *unused)
+module_export_counters(PyObject *mod, PyObject *args)
 {
-    PyObject *res = PyTuple_New(Py_SIZE(self) - 1);
-    if (res == NULL) {
+    PyObject *buffer;
+    Py_ssize_t max_entries;
+    unsigned long long pid;
+    if (!PyArg_ParseTuple(args, "OnK:_export_counters",
+            &buffer, &max_entries, &pid)) {
         return NULL;
     }
-    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
-        PyObject *known_params = self->args[i].known_params;
-        PyObject *param_counts;
-        if (known_params == NULL) {
-            known_params = Py_None;
-            Py_INCREF(Py_None);
-            param_counts = Py_None;
+    if (arena != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Counters are already exported.");
+        return NULL;
+    }
+    Py_buffer view;
+    if (PyObject_GetBuffer(buffer, &view, PyBUF_WRITABLE) < 0) {
+        return NULL;
+    }
+    uint64_t entries_offset = (sizeof(arena_header) + CACHE_LINE - 1)
+                              / CACHE_LINE * CACHE_LINE;
+    uint64_t data_offset = entries_offset + max_entries * sizeof(arena_entry);
+    data_offset = (data_offset + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    if (max_entries < 0 || (uint64_t)view.len < data_offset ||
+            ((uintptr_t)view.buf % CACHE_LINE) != 0) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError,
+                "Buffer must be aligned and large enough for the entries.");
+        return NULL;
+    }
+
+    arena_header *header = view.buf;
+    memset(header, 0, data_offset);
+    header->version = ARENA_VERSION;
+    header->header_size = sizeof(arena_header);
+    header->arena_size = view.len;
+    header->pid = pid;
+    header->max_entries = max_entries;
+    header->data_used = data_offset;
+    header->entries_offset = entries_offset;
+    header->entry_size = sizeof(arena_entry);
+    header->shards = COUNTER_SHARDS;
+    header->counter_size = sizeof(Py_ssize_t);
+    header->hist_buckets = HIST_BUCKETS;
+    header->hist_sub_bits = HIST_SUB_BITS;
+    header->hist_stride = HIST_STRIDE;
+    header->off_total_calls = offsetof(statscounters, total_calls);
+    header->off_invalid_args = offsetof(statscounters, invalid_args);
+    header->off_error_results = offsetof(statscounters, error_results);
+    header->off_timed_calls = offsetof(statscounters, timed_calls);
+    header->off_total_time = offsetof(statscounters, total_time);
+    header->off_min_time = offsetof(statscounters, min_time);
+    header->off_max_time = offsetof(statscounters, max_time);
+    header->off_est_total_time = offsetof(statscounters, est_total_time);
+    /* Readers check the magic last */
+    memcpy(header->magic, ARENA_MAGIC, sizeof(header->magic));
+
+    REGISTRY_LOCK();
+    arena_view = view;
+    arena = header;
+    REGISTRY_UNLOCK();
+
+    /*
+     * Wrappers created from now on start in the arena.  Move the existing
+     * ones, holding references so that none is deallocated meanwhile.
+     */
+    wrapper_index existing;
+    if (wrapper_index_build(&existing) < 0) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < existing.n; i++) {
+        StatsWrapperObject *w = existing.wrappers[i];
+        REGISTRY_LOCK();
+        if (w->arena_entry >= 0) {
+            REGISTRY_UNLOCK();
+            continue;
         }
-        else {
-            Py_ssize_t n_known_params = PyTuple_GET_SIZE(known_params);
-            param_counts = PyTuple_New(n_known_params);
-            if (param_counts == NULL) {
-                Py_DECREF(res);
-                return NULL;
-            }
-            for (Py_ssize_t j = 0; j < n_known_params; j++) {
-                PyObject *count = PyLong_FromSsize_t(self->args[i].param_counts[j]);
-                if (count == NULL) {
-                    Py_DECREF(res);
-                    Py_DECREF(param_counts);
-                    return NULL;
-                }
-                PyTuple_SET_ITEM(param_counts, j, count);
-            }
+        Py_ssize_t size = w->counters_stride * COUNTER_SHARDS;
+        char *counters = arena_allocate(w, w->counters_stride);
+        if (counters == NULL) {
+            REGISTRY_UNLOCK();
+            continue;
         }
-        PyObject *item = Py_BuildValue("OnON",
-            self->args[i].kwname ? self->args[i].kwname : Py_None,
-            self->args[i].count, known_params, param_counts);
-        if (item == NULL) {
-            Py_DECREF(res);
-            return NULL;
+        memcpy(counters, w->counters, size);
+        /*
+         * Calls in progress (or other threads) may still be writing to the
+         * old counters, so they cannot be freed yet (increments happening
+         * during the move are lost).
+         */
+#ifdef Py_GIL_DISABLED
+        _Py_atomic_store_ptr_release(&w->counters, counters);
+#else
+        w->counters = counters;
+#endif
+        retire_counters(w->counters_alloc);
+        w->counters_alloc = NULL;
+        if (w->histograms_alloc != NULL) {
+            char *histograms = arena_allocate_histograms(w);
+            if (histograms != NULL) {
+                memcpy(histograms, w->histograms, COUNTER_SHARDS * HIST_STRIDE);
+#ifdef Py_GIL_DISABLED
+                _Py_atomic_store_ptr_release(&w->histograms, histograms);
+#else
+                w->histograms = histograms;
+#endif
+                retire_counters(w->histograms_alloc);
+                w->histograms_alloc = NULL;
+            }
         }
-        PyTuple_SET_ITEM(res, i, item);
+        REGISTRY_UNLOCK();
     }
-    return res;
+    wrapper_index_clear(&existing);
+    Py_RETURN_NONE;
+}
+
+
+#ifdef HAVE_MONITORING
+/*
+ * sys.monitoring (PEP 669) backend: instead of replacing a function with a
+ * wrapper, the wrapper is attached to the function's code object (as code
+ * extra) and the PY_START, PY_RETURN and PY_UNWIND callbacks below feed its
+ * counters.  PY_START and PY_RETURN are only enabled for the registered
+ * code (as local events), the callbacks return DISABLE for code whose
+ * wrapper was freed.  PY_UNWIND can only be enabled globally.
+ * Argument stats are not available this way, only call counts and timings.
+ */
+static Py_ssize_t monitor_extra_index = -1;
+static PyObject *monitoring_disable = NULL;
+
+
+static StatsWrapperObject *
+get_monitored(PyObject *code)
+{
+    void *extra = NULL;
+    if (!PyCode_Check(code) ||
+            PyUnstable_Code_GetExtra(code, monitor_extra_index, &extra) < 0) {
+        PyErr_Clear();
+        return NULL;
+    }
+    return (StatsWrapperObject *)extra;
 }
 
 
 static PyObject *
-statswrapper__set_npos(StatsWrapperObject *self, PyObject *arg)
+monitor_py_start(PyObject *mod, PyObject *const *args, Py_ssize_t nargs)
 {
-    Py_ssize_t npos = PyLong_AsSsize_t(arg);
-    if (npos == -1 && PyErr_Occurred()) {
+    if (nargs < 1) {
+        PyErr_SetString(PyExc_TypeError, "expected code object.");
         return NULL;
     }
-    if (npos < self->npos_only || npos > Py_SIZE(self) - 1) {
-        PyErr_SetString(PyExc_ValueError,
-                "invalid new value for npos for the function.");
+    StatsWrapperObject *self = get_monitored(args[0]);
+    if (self == NULL) {
+        return Py_NewRef(monitoring_disable);
     }
-    self->npos = npos;
+    if (!stats_enabled) {
+        Py_RETURN_NONE;
+    }
+    statscounters *counters = get_counters(self);
+    COUNTER_ADD(counters->total_calls, 1);
+
+    Py_ssize_t interval = 0;
+    Py_ssize_t countdown = COUNTER_LOAD(counters->sample_countdown);
+    if (countdown > 1) {
+        COUNTER_STORE(counters->sample_countdown, countdown - 1);
+    }
+    else {
+        interval = COUNTER_LOAD(counters->sample_interval);
+        COUNTER_STORE(counters->sample_countdown, interval);
+    }
+    (void)push_frame(self, interval);
     Py_RETURN_NONE;
 }
 
 
+/*
+ * Pop the call to `self` from the stack and record it.  Frames above it are
+ * stale (e.g. the code was registered while running) and dropped as well.
+ */
 static void
-statswrapper_dealloc(StatsWrapperObject *self)
+monitor_pop(StatsWrapperObject *self, int error)
 {
-    Py_DECREF(self->wrapped);
-    for (Py_ssize_t i = 0; i < Py_SIZE(self) - 1; i++) {
-        Py_XDECREF(self->args[i].kwname);
-        Py_XDECREF(self->args[i].known_params);
-        PyMem_Free(self->args[i].param_counts);
+    statscounters *counters = get_counters(self);
+    if (error) {
+        COUNTER_ADD(counters->error_results, 1);
+    }
+    if (call_depth > CALL_STACK_MAX) {
+        pop_frame(self, counters, call_depth - 1, -1);
+        return;
+    }
+    for (Py_ssize_t depth = call_depth - 1; depth >= 0; depth--) {
+        if (call_stack[depth].wrapper == self) {
+            pop_frame(self, counters, depth, -1);
+            return;
+        }
     }
-    PyObject_FREE(self);
 }
 
 
 static PyObject *
-statswrapper___get__(PyObject *self, PyObject *obj, PyObject *cls)
+monitor_py_return(PyObject *mod, PyObject *const *args, Py_ssize_t nargs)
 {
-    if (obj == NULL) {
-        /* Act like a static method, no need to bind */
-        Py_INCREF(self);
-        return self;
+    if (nargs < 1) {
+        PyErr_SetString(PyExc_TypeError, "expected code object.");
+        return NULL;
     }
-    return PyMethod_New(self, obj);
+    StatsWrapperObject *self = get_monitored(args[0]);
+    if (self == NULL) {
+        return Py_NewRef(monitoring_disable);
+    }
+    monitor_pop(self, 0);
+    Py_RETURN_NONE;
 }
 
 
-static struct PyGetSetDef statswrapper_getset[] = {
-    {"__dict__", &PyObject_GenericGetDict, 0, NULL, 0},
-    {0, 0, 0, 0, 0}
-};
-
-
-static PyMethodDef statswrapper_methods[] = {
-    {"_get_counts",
-        (PyCFunction)statswrapper__get_counts,
-        METH_NOARGS, NULL},
-    {"_get_timing",
-        (PyCFunction)statswrapper__get_timing,
-        METH_NOARGS, NULL},
-    {"_get_param_stats",
-        (PyCFunction)statswrapper__get_param_stats,
-        METH_NOARGS, NULL},
-    {"_set_npos",
-        (PyCFunction)statswrapper__set_npos,
-        METH_O, NULL},
-    {NULL, NULL, 0, NULL}
-};
-
-
-static PyTypeObject StatsWrapper_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "stats_wrapper._StatsWrapper",
-    .tp_basicsize = sizeof(StatsWrapperObject),
-    .tp_itemsize = sizeof(arginfo),
-    .tp_dealloc = (destructor)statswrapper_dealloc,
-    // TODO: We should plausibly traverse dict and `wrapped`.  This doesn't
-    //       matter for non-dynamic functions in practice.
-    .tp_flags = (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL),
-    .tp_call = &PyVectorcall_Call,
-    .tp_vectorcall_offset = offsetof(StatsWrapperObject, vectorcall),
-    .tp_dictoffset = offsetof(StatsWrapperObject, dict),
-    .tp_descr_get = statswrapper___get__,
-    .tp_getset = statswrapper_getset,
-    .tp_methods = statswrapper_methods,
-};
+static PyObject *
+monitor_py_unwind(PyObject *mod, PyObject *const *args, Py_ssize_t nargs)
+{
+    /* PY_UNWIND cannot be disabled per location */
+    if (nargs < 1) {
+        PyErr_SetString(PyExc_TypeError, "expected code object.");
+        return NULL;
+    }
+    StatsWrapperObject *self = get_monitored(args[0]);
+    if (self != NULL) {
+        monitor_pop(self, 1);
+    }
+    Py_RETURN_NONE;
+}
 
 
 /*
- * Factory for the StatsWrapper object creation.
+ * Detach the wrapper from the code feeding it, must be called with the
+ * registry lock held.  The code extra is a borrowed reference (a strong one
+ * would hide the cycle through the function from the GC), so this must run
+ * before the wrapper is freed.  Returns the reference to the code, which the
+ * caller releases after unlocking.
  */
 static PyObject *
-stats_wrapper_create(PyObject *mod,
-        PyObject *const *args, Py_ssize_t len_args, PyObject *kwnames)
+monitor_detach(StatsWrapperObject *self)
 {
-    Py_ssize_t nargs = PyVectorcall_NARGS(len_args);
-    if (nargs < 1) {
-        PyErr_SetString(PyExc_TypeError, "Must pass at least one callable.");
+    PyObject *code = self->monitored_code;
+    if (code == NULL) {
         return NULL;
     }
-    /* Store the wrapped one, and treat all other arguments as generic args */
-    PyObject *wrapped = args[0];
-    args++;
-    nargs--;
-
-    Py_ssize_t total_args = nargs;
-    if (kwnames != NULL) {
-        total_args += PyTuple_GET_SIZE(kwnames);
-    }
-    StatsWrapperObject *statswrapper = (StatsWrapperObject *)PyObject_NewVar(
-        StatsWrapperObject, &StatsWrapper_Type, total_args + 1);
-    if (statswrapper == NULL) {
-        return NULL;
+    self->monitored_code = NULL;
+    if (get_monitored(code) == self) {
+        (void)PyUnstable_Code_SetExtra(code, monitor_extra_index, NULL);
     }
+    return code;
+}
 
-    statswrapper->vectorcall = (vectorcallfunc)statswrapper_vectorcall;
-    statswrapper->npos_only = nargs;
-    // Allow setting the number of positional args (i.e. enforce kwarg only).
-    statswrapper->npos = total_args;
-    statswrapper->total_calls = 0;
-    statswrapper->error_results = 0;
-    statswrapper->invalid_args = 0;
-    statswrapper->total_time = 0.0;
-    statswrapper->min_time = 0.0;
-    statswrapper->max_time = 0.0;
-    // Ensure we can dealloc and also NULL terminate.
-    memset(statswrapper->args, 0, sizeof(arginfo) * (total_args + 1));
 
-    Py_INCREF(wrapped);
-    statswrapper->wrapped = wrapped;
-    statswrapper->dict = PyDict_New();
-    if (statswrapper->dict == NULL) {
-        Py_DECREF(statswrapper);
+/*
+ * Attach `wrapper` to `code`, replacing a previous wrapper.  The caller must
+ * keep the wrapper alive (the code only borrows it) and enable the events
+ * for the code.
+ */
+static PyObject *
+monitor_register(PyObject *mod, PyObject *args)
+{
+    PyObject *code;
+    StatsWrapperObject *self;
+    if (!PyArg_ParseTuple(args, "O!O!:_monitor_register",
+            &PyCode_Type, &code, &StatsWrapper_Type, &self)) {
         return NULL;
     }
-
-    for (Py_ssize_t i = 0; i < total_args; i++) {
-        if (i >= nargs) {
-            statswrapper->args[i].kwname = PyTuple_GET_ITEM(kwnames, i - nargs);
-            Py_INCREF(statswrapper->args[i].kwname);
-            /* should be interned, but lets make sure */
-            PyUnicode_InternInPlace(&statswrapper->args[i].kwname);
-        }
-        if (args[i] == Py_None) {
-            continue;
+    if (monitoring_disable == NULL) {
+        PyObject *monitoring = PySys_GetObject("monitoring");  // borrowed
+        if (monitoring == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "sys.monitoring not found.");
+            return NULL;
         }
-        if (!PyTuple_Check(args[i])) {
-            PyErr_SetString(PyExc_TypeError,
-                "All arguments must be None, or tuples.");
-            Py_DECREF(statswrapper);
+        monitoring_disable = PyObject_GetAttrString(monitoring, "DISABLE");
+        if (monitoring_disable == NULL) {
             return NULL;
         }
-        /* The typical case: We have a tuple with values to check for. */
-        Py_INCREF(args[i]);
-        statswrapper->args[i].known_params = args[i];
-        size_t num = PyTuple_GET_SIZE(args[i]);
-        statswrapper->args[i].param_counts = PyMem_Calloc(num, sizeof(Py_ssize_t));
-        if (statswrapper->args[i].param_counts == NULL) {
-            Py_DECREF(statswrapper);
-            return PyErr_NoMemory();
+    }
+    if (monitor_extra_index < 0) {
+        monitor_extra_index = PyUnstable_Eval_RequestCodeExtraIndex(NULL);
+        if (monitor_extra_index < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "no code extra index available.");
+            return NULL;
         }
     }
 
-    return (PyObject *)statswrapper;
+    REGISTRY_LOCK();
+    PyObject *old_code = monitor_detach(self);
+    StatsWrapperObject *prev = get_monitored(code);
+    PyObject *prev_code = NULL;
+    if (prev != NULL) {
+        prev_code = monitor_detach(prev);
+        set_vectorcall(prev, select_vectorcall(prev));
+    }
+    int res = PyUnstable_Code_SetExtra(code, monitor_extra_index, self);
+    if (res == 0) {
+        self->monitored_code = Py_NewRef(code);
+    }
+    set_vectorcall(self, select_vectorcall(self));
+    REGISTRY_UNLOCK();
+    Py_XDECREF(old_code);
+    Py_XDECREF(prev_code);
+    if (res < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Detach `wrapper` from its code again, it then counts its own calls.
+ * Returns the code, or None if it was not attached (anymore).
+ */
+static PyObject *
+monitor_unregister(PyObject *mod, PyObject *wrapper)
+{
+    if (!PyObject_TypeCheck(wrapper, &StatsWrapper_Type)) {
+        PyErr_SetString(PyExc_TypeError, "wrapper must be a _StatsWrapper.");
+        return NULL;
+    }
+    StatsWrapperObject *self = (StatsWrapperObject *)wrapper;
+    REGISTRY_LOCK();
+    PyObject *code = monitor_detach(self);
+    set_vectorcall(self, select_vectorcall(self));
+    REGISTRY_UNLOCK();
+    if (code == NULL) {
+        Py_RETURN_NONE;
+    }
+    return code;
 }
+#endif
 
 
 static struct PyMethodDef module_methods[] = {
-    {"stats_wrapper", (PyCFunction)stats_wrapper_create,
+    {"stats_wrapper", (PyCFunction)(void(*)(void))stats_wrapper_create,
         METH_FASTCALL | METH_KEYWORDS, "StatsWrapper creation helper"},
+    {"disable", (PyCFunction)module_disable, METH_NOARGS,
+        "Make all wrappers only forward calls without gathering stats."},
+    {"enable", (PyCFunction)module_enable, METH_NOARGS,
+        "Re-enable gathering stats for all wrappers."},
+    {"is_enabled", (PyCFunction)module_is_enabled, METH_NOARGS,
+        "Whether stats are currently gathered."},
+    {"_export_counters", (PyCFunction)module_export_counters, METH_VARARGS,
+        NULL},
+    {"collected_stats", (PyCFunction)module_collected_stats, METH_NOARGS,
+        "The counts of deallocated wrappers, summed by module."},
+    {"snapshot_all", (PyCFunction)module_snapshot_all, METH_NOARGS,
+        "Snapshot the counters of all live wrappers into a StatsSnapshot."},
+    {"snapshot_and_reset_all", (PyCFunction)module_snapshot_and_reset_all,
+        METH_NOARGS,
+        "Snapshot and reset all wrappers called since the last reset."},
+#ifdef HAVE_MONITORING
+    {"_monitor_py_start", (PyCFunction)(void(*)(void))monitor_py_start,
+        METH_FASTCALL, NULL},
+    {"_monitor_py_return", (PyCFunction)(void(*)(void))monitor_py_return,
+        METH_FASTCALL, NULL},
+    {"_monitor_py_unwind", (PyCFunction)(void(*)(void))monitor_py_unwind,
+        METH_FASTCALL, NULL},
+    {"_monitor_register", (PyCFunction)monitor_register, METH_VARARGS, NULL},
+    {"_monitor_unregister", (PyCFunction)monitor_unregister, METH_O, NULL},
+#endif
     {NULL, NULL, 0, NULL}
 };
 
+/* The interned specs are only reachable through the module. */
+static int
+module_traverse(PyObject *mod, visitproc visit, void *arg)
+{
+    Py_VISIT(signature_specs);
+    return 0;
+}
+
+
+static void
+module_free(void *mod)
+{
+    while (retired_head != NULL) {
+        retired_counters *retired = retired_head;
+        retired_head = retired->next;
+        PyMem_Free(retired->alloc);
+        PyMem_RawFree(retired);
+    }
+}
+
 static PyModuleDef moduledef = {
     .m_base = PyModuleDef_HEAD_INIT,
     .m_name = "_stats_wrapper",
-    .m_methods = module_methods
+    .m_methods = module_methods,
+    .m_traverse = module_traverse,
+    .m_free = module_free
 };
 
 
@@ -431,21 +6062,53 @@ PyMODINIT_FUNC PyInit__stats_wrapper(void)
 {
     PyObject *m = PyModule_Create(&moduledef);
 
-    if (PyType_Ready(&StatsWrapper_Type) < 0) {
+    if (PyType_Ready(&StatsWrapper_Type) < 0 ||
+            PyType_Ready(&SignatureSpec_Type) < 0) {
         goto error;
     }
     if (PyModule_AddObject(m, "_StatsWrapper", (PyObject *)&StatsWrapper_Type) < 0) {
         goto error;
     }
+    if (PyType_Ready(&QuantileSketch_Type) < 0) {
+        goto error;
+    }
+    Py_INCREF(&QuantileSketch_Type);
+    if (PyModule_AddObject(m, "QuantileSketch", (PyObject *)&QuantileSketch_Type) < 0) {
+        goto error;
+    }
+    if (PyType_Ready(&StatsSnapshot_Type) < 0) {
+        goto error;
+    }
+    if (PyType_Ready(&TimedGenerator_Type) < 0 ||
+            PyType_Ready(&TimedCoroutine_Type) < 0 ||
+            PyType_Ready(&TimedAsyncGenerator_Type) < 0) {
+        goto error;
+    }
+    Py_INCREF(&StatsSnapshot_Type);
+    if (PyModule_AddObject(m, "StatsSnapshot", (PyObject *)&StatsSnapshot_Type) < 0) {
+        goto error;
+    }
 
-    /* Get reference to time.perf_counter for timing measurements */
-    PyObject *time_module = PyImport_ImportModule("time");
-    if (time_module == NULL) {
+#if !defined(HAVE_PYTIME_PERFCOUNTER) && defined(_WIN32)
+    QueryPerformanceFrequency(&perf_frequency);
+#endif
+#ifdef Py_GIL_DISABLED
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
+    signature_specs = PyDict_New();
+    if (signature_specs == NULL) {
         goto error;
     }
-    perf_counter_func = PyObject_GetAttrString(time_module, "perf_counter");
-    Py_DECREF(time_module);
-    if (perf_counter_func == NULL) {
+    str_array_interface = PyUnicode_InternFromString("__array_interface__");
+    str_send = PyUnicode_InternFromString("send");
+    str_throw = PyUnicode_InternFromString("throw");
+    str_close = PyUnicode_InternFromString("close");
+    str_asend = PyUnicode_InternFromString("asend");
+    str_athrow = PyUnicode_InternFromString("athrow");
+    str_aclose = PyUnicode_InternFromString("aclose");
+    if (str_array_interface == NULL || str_send == NULL ||
+            str_throw == NULL || str_close == NULL || str_asend == NULL ||
+            str_athrow == NULL || str_aclose == NULL) {
         goto error;
     }
 
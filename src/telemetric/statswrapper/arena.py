@@ -0,0 +1,270 @@
+# Copyright (c) 2025 Scientific Python. All rights reserved.
+# pylint: disable=import-error,no-name-in-module
+"""Shared memory export of the wrapper counters.
+
+`export_counters` moves the counters of all wrappers into a memory mapped
+file, `ArenaReader` maps such a file (read-only) from any process and reads
+the counters without involving the process that writes them.
+"""
+
+from __future__ import annotations
+
+import atexit
+import mmap
+import os
+import struct
+import tempfile
+from typing import NamedTuple
+
+from ._stats_wrapper import _export_counters  # type: ignore[import-not-found]
+
+__all__ = [
+    "ArenaReader",
+    "FunctionCounters",
+    "default_path",
+    "export_counters",
+    "histogram_quantile",
+]
+
+MAGIC = b"TLMARENA"
+VERSION = 2
+
+# See `arena_header` and `arena_entry` in _stats_wrapper.c
+_HEADER = struct.Struct("=8s23Q")
+_HEADER_FIELDS = (
+    "magic",
+    "version",
+    "header_size",
+    "arena_size",
+    "pid",
+    "max_entries",
+    "n_entries",
+    "data_used",
+    "dropped",
+    "entries_offset",
+    "entry_size",
+    "shards",
+    "counter_size",
+    "hist_buckets",
+    "hist_sub_bits",
+    "hist_stride",
+    "off_total_calls",
+    "off_invalid_args",
+    "off_error_results",
+    "off_timed_calls",
+    "off_total_time",
+    "off_min_time",
+    "off_max_time",
+    "off_est_total_time",
+)
+_ENTRY = struct.Struct("=QQQ")
+_INT64_MAX = 2**63 - 1
+
+_exported: tuple[str, mmap.mmap] | None = None
+
+
+def default_path(pid: int | None = None) -> str:
+    """The file used by `export_counters` for process ``pid``."""
+    if pid is None:
+        pid = os.getpid()
+    directory = "/dev/shm" if os.path.isdir("/dev/shm") else tempfile.gettempdir()
+    return os.path.join(directory, f"telemetric-{pid}.counters")
+
+
+def export_counters(
+    path: str | None = None, *, size: int = 16 * 2**20, max_entries: int = 4096
+) -> str:
+    """Allocate the counters of all (current and future) wrappers in a
+    shared memory mapped file.
+
+    Can only be done once per process, later calls return the existing path.
+    The file is created readable by the current user only (it must not exist
+    yet) and removed at exit.  Once the file is full (``size`` bytes or
+    ``max_entries`` wrappers), new wrappers use private memory again.
+    Forked children keep writing to the same file, so export in the child
+    only.
+
+    Returns
+    -------
+    path : str
+        The path of the file, by default `default_path()`.
+    """
+    global _exported  # noqa: PLW0603  # pylint: disable=global-statement
+    if _exported is not None:
+        return _exported[0]
+    if path is None:
+        path = default_path()
+
+    # The default path is predictable, so never follow a symlink or reuse a
+    # file someone else created there.
+    flags = os.O_RDWR | os.O_CREAT | os.O_EXCL | getattr(os, "O_NOFOLLOW", 0)
+    fd = os.open(path, flags, 0o600)
+    try:
+        os.ftruncate(fd, size)
+        buffer = mmap.mmap(fd, size)
+    except BaseException:
+        _remove(path)
+        raise
+    finally:
+        os.close(fd)
+    _export_counters(buffer, max_entries, os.getpid())
+    _exported = (path, buffer)
+    atexit.register(_remove, path)
+    return path
+
+
+def _remove(path: str) -> None:
+    try:
+        os.unlink(path)
+    except OSError:
+        pass
+
+
+def _bucket_start(bucket: int, sub_bits: int) -> int:
+    # See `histogram_bucket_start` in _stats_wrapper.c
+    sub_count = 1 << sub_bits
+    if bucket < sub_count:
+        return bucket
+    shift = bucket // sub_count - 1
+    return (bucket % sub_count + sub_count) << shift
+
+
+def histogram_quantile(histogram: tuple[int, ...], q: float, sub_bits: int) -> float:
+    """Estimate the ``q`` quantile (in seconds) of a histogram as read by
+    `ArenaReader` (the bucket midpoint, like ``_get_histogram``).
+
+    The result is within ``2**-(sub_bits + 1)`` of the true quantile
+    (relative), e.g. 6.25% for ``sub_bits=3``."""
+    total = sum(histogram)
+    if total == 0:
+        return 0.0
+    rank = q * total
+    cumulative = 0
+    bucket = 0
+    for bucket, count in enumerate(histogram[:-1]):  # noqa: B007
+        cumulative += count
+        if cumulative > 0 and cumulative >= rank:
+            break
+    else:
+        bucket = len(histogram) - 1
+    start = _bucket_start(bucket, sub_bits)
+    end = _bucket_start(bucket + 1, sub_bits)
+    return (start + end) / 2 * 1e-9
+
+
+class FunctionCounters(NamedTuple):
+    """Counters of one wrapper, summed over all shards (times in seconds)."""
+
+    name: str
+    calls: int
+    errors: int
+    invalid_args: int
+    timed_calls: int
+    total_time: float
+    min_time: float
+    max_time: float
+    est_total_time: float
+    histogram: tuple[int, ...]
+
+
+class ArenaReader:
+    """Read-only view of the counters exported by `export_counters`.
+
+    Parameters
+    ----------
+    path : str or int
+        The exported file, or the pid of the process (if it used the
+        default path).
+    """
+
+    def __init__(self, path: str | int) -> None:
+        if isinstance(path, int):
+            path = default_path(path)
+        self.path = path
+        with open(path, "rb") as f:
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        values = _HEADER.unpack_from(self._map, 0)
+        header = dict(zip(_HEADER_FIELDS, values))
+        if header["magic"] != MAGIC or header["version"] != VERSION:
+            self._map.close()
+            msg = f"{path} is not a telemetric counter file."
+            raise ValueError(msg)
+        self._header = header
+        self.pid: int = header["pid"]
+        count = "q" if header["counter_size"] == 8 else "i"
+        self._count = f"={count}"
+        self._hist = struct.Struct(f"={header['hist_buckets']}{count}")
+
+    def close(self) -> None:
+        self._map.close()
+
+    def __enter__(self) -> ArenaReader:
+        return self
+
+    def __exit__(self, *exc: object) -> None:
+        self.close()
+
+    @property
+    def hist_sub_bits(self) -> int:
+        return int(self._header["hist_sub_bits"])
+
+    def read(self) -> list[FunctionCounters]:
+        """Read the current counters of all live wrappers."""
+        h = self._header
+        n_entries_offset = _HEADER_FIELDS.index("n_entries") * 8
+        n_entries = struct.unpack_from("=Q", self._map, n_entries_offset)[0]
+        result = []
+        for i in range(n_entries):
+            entry_offset = h["entries_offset"] + i * h["entry_size"]
+            offset, stride, hist_offset = _ENTRY.unpack_from(
+                self._map, entry_offset
+            )
+            if offset == 0:
+                continue  # wrapper was deallocated
+            raw_name = self._map[
+                entry_offset + _ENTRY.size : entry_offset + h["entry_size"]
+            ]
+            name = raw_name.split(b"\0", 1)[0].decode("utf-8", "replace")
+
+            counts = [0, 0, 0, 0]
+            times = [0, 0, 0]
+            min_time = _INT64_MAX
+            histogram = [0] * h["hist_buckets"]
+            for shard in range(h["shards"]):
+                base = offset + shard * stride
+                for j, field in enumerate(
+                    ("total_calls", "error_results", "invalid_args", "timed_calls")
+                ):
+                    counts[j] += struct.unpack_from(
+                        self._count, self._map, base + h[f"off_{field}"]
+                    )[0]
+                for j, field in enumerate(
+                    ("total_time", "max_time", "est_total_time")
+                ):
+                    value = struct.unpack_from(
+                        "=q", self._map, base + h[f"off_{field}"]
+                    )[0]
+                    times[j] = max(times[j], value) if j == 1 else times[j] + value
+                min_time = min(
+                    min_time,
+                    struct.unpack_from("=q", self._map, base + h["off_min_time"])[0],
+                )
+                if hist_offset:  # only allocated on the first timed call
+                    shard_hist = self._hist.unpack_from(
+                        self._map, hist_offset + shard * h["hist_stride"]
+                    )
+                    histogram = [a + b for a, b in zip(histogram, shard_hist)]
+            if min_time == _INT64_MAX:
+                min_time = 0
+            result.append(
+                FunctionCounters(
+                    name,
+                    *counts,
+                    times[0] * 1e-9,
+                    min_time * 1e-9,
+                    times[1] * 1e-9,
+                    times[2] * 1e-9,
+                    tuple(histogram),
+                )
+            )
+        return result
@@ -0,0 +1,85 @@
+# Copyright (c) 2025 Scientific Python. All rights reserved.
+# pylint: disable=import-error,no-name-in-module
+"""Call graph between wrapped functions.
+
+Every wrapper counts its calls by (wrapped) caller, `call_graph` collects
+these edges from all live wrappers and `write_collapsed` writes them in the
+collapsed stack format read by flame graph tools (e.g. ``flamegraph.pl`` or
+speedscope).
+"""
+
+from __future__ import annotations
+
+from typing import TYPE_CHECKING, NamedTuple, TextIO
+
+from ._stats_wrapper import snapshot_all  # type: ignore[import-not-found]
+
+if TYPE_CHECKING:
+    from ._stats_wrapper import _StatsWrapper  # type: ignore[import-not-found]
+
+__all__ = ["CallEdge", "call_graph", "write_collapsed"]
+
+
+class CallEdge(NamedTuple):
+    """Calls from ``caller`` to ``callee`` (times are estimates in seconds).
+
+    ``caller`` is None for calls from callers that are gone or that did not
+    fit into the bounded table of the callee.
+    """
+
+    caller: _StatsWrapper | None
+    callee: _StatsWrapper
+    calls: int
+    time: float
+    self_time: float
+
+
+def call_graph() -> list[CallEdge]:
+    """Collect the caller -> callee edges between all live wrappers."""
+    edges = []
+    for callee in snapshot_all().wrappers:
+        for caller, calls, time, self_time in callee._get_callers():  # pylint: disable=protected-access
+            edges.append(CallEdge(caller, callee, calls, time, self_time))
+    return edges
+
+
+def _frame_name(func: _StatsWrapper | None) -> str:
+    if func is None:
+        return "[unknown]"
+    name = getattr(func, "__name__", None)
+    name = repr(func) if name is None else f"{func.__module__}.{name}"
+    # ";" separates frames and the weight follows the last space.
+    return name.replace(";", ":").replace(" ", "_")
+
+
+def write_collapsed(file: TextIO, weight: str = "time") -> None:
+    """Write the call graph in collapsed stack format.
+
+    Each line is ``caller;callee weight``, or ``function weight`` for calls
+    without a wrapped caller.  Stacks are thus only two frames deep.
+
+    Parameters
+    ----------
+    file : file-like
+        Text file to write to.
+    weight : {"time", "calls"}
+        Weight the stacks by the estimated self time (in integer
+        nanoseconds, so that each function's width is its total time) or by
+        the number of calls.
+    """
+    if weight not in ("time", "calls"):
+        msg = f"weight must be 'time' or 'calls', not {weight!r}."
+        raise ValueError(msg)
+
+    snapshot = snapshot_all()
+    column = snapshot.column("est_self_ns" if weight == "time" else "calls")
+    for i, callee in enumerate(snapshot.wrappers):
+        remaining = column[i]
+        name = _frame_name(callee)
+        for caller, calls, _, self_time in callee._get_callers():  # pylint: disable=protected-access
+            value = calls if weight == "calls" else round(self_time * 1e9)
+            remaining -= value
+            if value > 0:
+                file.write(f"{_frame_name(caller)};{name} {value}\n")
+        if remaining > 0:
+            file.write(f"{name} {remaining}\n")
@@ -0,0 +1,124 @@
+"""
+Live view of the counters of a running process.
+
+The process must have called `telemetric.statswrapper.export_counters()`.
+Usage::
+
+    python -m telemetric.top <pid> [--interval SECONDS] [--limit N]
+
+Shows calls per second, error rate and latency of each wrapped function
+over the last interval, sorted by the time spent in it.  The counters are
+only read (from shared memory), the process is not interrupted.
+"""
+
+from __future__ import annotations
+
+import argparse
+import sys
+import time
+from collections.abc import Sequence
+
+from telemetric.statswrapper.arena import (
+    ArenaReader,
+    FunctionCounters,
+    histogram_quantile,
+)
+
+__all__ = ["main", "render"]
+
+_HEADER = f"{'calls/s':>10} {'err %':>6} {'avg':>9} {'p99':>9} {'time %':>7}  function"
+
+
+def _format_time(seconds: float) -> str:
+    for unit, scale in (("s", 1), ("ms", 1e-3), ("us", 1e-6)):
+        if seconds >= scale:
+            return f"{seconds / scale:.3g}{unit}"
+    return f"{seconds / 1e-9:.3g}ns"
+
+
+def render(
+    previous: Sequence[FunctionCounters],
+    current: Sequence[FunctionCounters],
+    elapsed: float,
+    sub_bits: int,
+    limit: int | None = None,
+) -> list[str]:
+    """Return the table lines for the change between two reads."""
+    before = {c.name: c for c in previous}
+    rows = []
+    for now in current:
+        old = before.get(now.name)
+        if old is not None and now.calls >= old.calls:
+            calls = now.calls - old.calls
+            errors = now.errors - old.errors
+            timed = now.timed_calls - old.timed_calls
+            total_time = now.total_time - old.total_time
+            spent = now.est_total_time - old.est_total_time
+            histogram = tuple(a - b for a, b in zip(now.histogram, old.histogram))
+        else:
+            # New function (or a new one with the same name).
+            calls, errors, timed = now.calls, now.errors, now.timed_calls
+            total_time, spent = now.total_time, now.est_total_time
+            histogram = now.histogram
+        if calls == 0:
+            continue
+        average = total_time / timed if timed else 0.0
+        p99 = histogram_quantile(histogram, 0.99, sub_bits)
+        rows.append((spent, calls, errors, average, p99, now.name))
+
+    rows.sort(reverse=True)
+    total_spent = sum(row[0] for row in rows) or 1.0
+    lines = [_HEADER]
+    for spent, calls, errors, average, p99, name in rows[:limit]:
+        lines.append(
+            f"{calls / elapsed:>10.1f} {100 * errors / calls:>6.1f} "
+            f"{_format_time(average):>9} {_format_time(p99):>9} "
+            f"{100 * spent / total_spent:>7.1f}  {name}"
+        )
+    return lines
+
+
+def main(argv: Sequence[str] | None = None) -> int:
+    parser = argparse.ArgumentParser(
+        prog="python -m telemetric.top", description=__doc__.split("\n\n")[1]
+    )
+    parser.add_argument("pid", help="process id (or path of the counter file)")
+    parser.add_argument("--interval", type=float, default=1.0)
+    parser.add_argument("--limit", type=int, default=30, help="rows to show")
+    parser.add_argument(
+        "--iterations", type=int, default=0, help="stop after N updates (0: never)"
+    )
+    args = parser.parse_args(argv)
+
+    target: int | str = int(args.pid) if args.pid.isdigit() else args.pid
+    try:
+        reader = ArenaReader(target)
+    except (OSError, ValueError) as e:
+        print(f"Cannot attach to {args.pid}: {e}", file=sys.stderr)  # noqa: T201
+        return 1
+
+    clear = "\x1b[H\x1b[2J" if sys.stdout.isatty() else ""
+    with reader:
+        previous = reader.read()
+        last = time.perf_counter()
+        iteration = 0
+        try:
+            while args.iterations == 0 or iteration < args.iterations:
+                time.sleep(args.interval)
+                current = reader.read()
+                now = time.perf_counter()
+                lines = render(
+                    previous, current, now - last, reader.hist_sub_bits, args.limit
+                )
+                p99_error = 100 / 2 ** (reader.hist_sub_bits + 1)
+                title = f"telemetric top - pid {reader.pid} (p99 within {p99_error:.3g}%)"
+                print(f"{clear}{title}\n" + "\n".join(lines), flush=True)  # noqa: T201
+                previous, last = current, now
+                iteration += 1
+        except KeyboardInterrupt:
+            pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
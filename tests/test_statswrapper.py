@@ -0,0 +1,885 @@
+from __future__ import annotations
+
+import array
+import asyncio
+import gc
+import io
+import os
+import sys
+import threading
+import time
+import weakref
+
+import pytest
+
+from telemetric import statswrapper
+from telemetric.statswrapper import (
+    ArenaReader,
+    QuantileSketch,
+    call_graph,
+    export_counters,
+    monitor,
+    stats_deco,
+    stats_deco_auto,
+    unmonitor,
+    write_collapsed,
+)
+
+
+def test_timing():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def func(delay):
+        time.sleep(delay)
+
+    func(0.01)
+    func(0.0)
+    timing = func._get_timing()
+    assert func._get_counts() == (2, 0, 0)
+    assert timing["min"] <= timing["average"] <= timing["max"]
+    assert timing["max"] >= 0.01
+    assert timing["total"] == pytest.approx(timing["average"] * 2)
+
+
+def test_sampling():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def func(x):
+        return x
+
+    func._set_sampling(10)
+    for i in range(100):
+        func(i)
+    assert func._get_counts() == (100, 0, 0)
+    assert func._get_param_stats() == ((None, 100, None, None),)
+    assert func._get_timing()["samples"] == 10
+
+    func._set_sampling(0)
+    func(1)
+    assert func._get_timing()["samples"] == 10
+
+    with pytest.raises(ValueError, match="max_rate"):
+        func._set_sampling(0, 100)
+
+
+def test_threaded_counts_are_exact():
+    @stats_deco(None, b=(True, False))  # type: ignore[no-untyped-call]
+    def func(a, b=False):
+        return a, b
+
+    def work():
+        for i in range(10_000):
+            func(i, b=True)
+
+    threads = [threading.Thread(target=work) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert func._get_counts() == (40_000, 0, 0)
+    assert func._get_param_stats() == (
+        (None, 40_000, None, None),
+        ("b", 40_000, (True, False), (40_000, 0)),
+    )
+    assert func._get_timing()["samples"] == 40_000
+
+
+def test_histogram():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def func(delay):
+        if delay:
+            time.sleep(delay)
+
+    for _ in range(98):
+        func(0)
+    func(0.02)
+    func(0.02)
+
+    hist = func._get_histogram()
+    assert sum(hist["buckets"]) == 100
+    assert list(hist["lower_bounds"]) == sorted(hist["lower_bounds"])
+    timing = func._get_timing()
+    assert timing["min"] <= hist["p50"] <= hist["p90"] < 0.02
+    # Buckets are up to 12.5% wide, the middle of the bucket is reported.
+    assert 0.0175 <= hist["p99"] <= hist["p999"] <= timing["max"]
+
+
+def test_quantile_sketch():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def func(x):
+        return x
+
+    assert func._get_sketch() is None
+    func._enable_sketch(relative_accuracy=0.02)
+    for i in range(100):
+        func(i)
+    sketch = func._get_sketch()
+    assert sketch.count == 100
+    assert sketch.relative_accuracy == pytest.approx(0.02)
+
+    other = QuantileSketch(0.02)
+    for value in [1e-3] * 100:
+        other.add(value)
+    merged = QuantileSketch.from_bytes(sketch.to_bytes())
+    merged.merge(other)
+    assert merged.count == 200
+    assert merged.quantile(0.99) == pytest.approx(1e-3, rel=0.02)
+    assert merged.quantile(0.0) <= sketch.quantile(0.5) <= 1e-3
+
+    with pytest.raises(ValueError, match="relative accuracy"):
+        merged.merge(QuantileSketch(0.05))
+    assert type(func).__module__ == QuantileSketch.__module__
+
+
+def test_known_params_lookup():
+    methods = tuple(f"method{i}" for i in range(30))
+
+    @stats_deco(method=(*methods, [1, 2], 2**100))  # type: ignore[no-untyped-call]
+    def func(method=None):
+        return method
+
+    func(method="".join(["method", "17"]))  # equal but not identical
+    func(method=2**100 + 0)
+    func(method=[1, 2])  # unhashable, compared one by one
+    func(method={"not": "tracked"})
+    func(method="other")
+
+    (name, n_uses, _, counts) = func._get_param_stats()[0]
+    assert (name, n_uses) == ("method", 5)
+    assert counts[17] == counts[30] == counts[31] == 1
+    assert sum(counts) == 3
+
+
+class _DTypeLike:
+    # Like NumPy dtypes: equal to its name, but with a different hash.
+    def __init__(self, name):  # type: ignore[no-untyped-def]
+        self.name = name
+
+    def __eq__(self, other):  # type: ignore[no-untyped-def]
+        if isinstance(other, _DTypeLike):
+            other = other.name
+        return self.name == other
+
+    def __hash__(self):  # type: ignore[no-untyped-def]
+        return hash(("dtype", self.name))
+
+
+def test_known_params_equal_with_other_hash():
+    @stats_deco(("float32", "float64"), (_DTypeLike("int64"), "x"))  # type: ignore[no-untyped-call]
+    def func(dtype, other):
+        return dtype
+
+    func(_DTypeLike("float64"), "int64")
+    func("float32", _DTypeLike("int64"))
+    func(_DTypeLike("int8"), "x")
+    stats = func._get_param_stats()
+    assert stats[0][3] == (1, 1)
+    assert stats[1][3] == (2, 1)
+
+    # Tuples are only hashed like their elements if all of them are builtins
+    @stats_deco((("float64",), "x"))  # type: ignore[no-untyped-call]
+    def nested(dtypes):
+        return dtypes
+
+    nested((_DTypeLike("float64"),))
+    nested(("float64",))
+    assert nested._get_param_stats()[0][3] == (2, 0)
+
+
+def test_kwnames_resolution():
+    @stats_deco(a=None, b=None, c=None)  # type: ignore[no-untyped-call]
+    def func(a=None, b=None, c=None, d=None):
+        return a, b, c, d
+
+    # More distinct call sites (kwnames tuples) than are cached
+    for _ in range(3):
+        func(a=1)
+        func(b=1, a=1)
+        func(c=1, b=1)
+        func(a=1, c=1)
+        func(c=1, b=1, a=1)
+        func(d=1)
+        func(d=1, a=1)
+        func(a=1, b=1, c=1)
+        func(b=1)
+        func(c=1)
+        func(**{"a": 1, "b": 2})
+    counts = {name: n for name, n, _, _ in func._get_param_stats()}
+    assert counts == {"a": 21, "b": 18, "c": 15}
+    assert func._get_counts() == (33, 0, 6)
+
+
+def test_known_params_identity():
+    values = (None, True, False, *range(7), "a", "b")
+
+    @stats_deco(values)  # type: ignore[no-untyped-call]
+    def func(x):
+        return x
+
+    for value in values:
+        for _ in range(3):
+            func(value)
+    func(100)
+    assert func._get_param_stats()[0][3] == (3,) * len(values)
+
+
+def test_type_stats():
+    def func(a, b=None):
+        return a, b
+
+    wrapped = stats_deco_auto(func)
+    wrapped(1)
+    wrapped(1.0, b=None)
+    wrapped("a", b=1)
+    for i in range(10):
+        wrapped(type(f"T{i}", (), {})())
+
+    ((name_a, types_a, other_a), (name_b, types_b, other_b)) = (
+        wrapped._get_type_stats()
+    )
+    assert name_a == "a"
+    assert types_a[int] == types_a[float] == types_a[str] == 1
+    assert len(types_a) == 8
+    assert other_a == 5
+    assert (name_b, types_b, other_b) == ("b", {type(None): 1, int: 1}, 0)
+
+    wrapped = stats_deco(None)(func)  # type: ignore[no-untyped-call]
+    wrapped(1)
+    with pytest.raises(RuntimeError, match="before the first call"):
+        wrapped._enable_type_stats()
+
+
+def test_array_stats():
+    def func(data, n=None):
+        return data, n
+
+    wrapped = stats_deco_auto(func, track_arrays=True)
+    wrapped(b"")
+    wrapped(bytearray(100))
+    wrapped(array.array("d", range(1000)))
+    wrapped(memoryview(bytes(24)).cast("B", (2, 3, 4)), n=[1, 2, 3])
+    wrapped(object(), n=1)
+
+    ((name, stats), (name_n, stats_n)) = wrapped._get_array_stats()
+    assert name == "data"
+    assert stats["sizes"] == {0: 1, 16: 1, 64: 1, 512: 1}
+    assert set(stats["size_timing"]) == set(stats["sizes"])
+    assert stats["ndim"] == {1: 3, 3: 1}
+    assert stats["dtypes"] == {"B": 3, "d": 1}
+    assert stats["other_dtypes"] == 0
+    assert stats["unsized"] == 1
+    assert name_n == "n"
+    assert stats_n["sizes"] == {2: 1}
+    assert stats_n["unsized"] == 1
+
+    wrapped = stats_deco_auto(func)
+    assert wrapped._get_array_stats() == (("data", None), ("n", None))
+    wrapped._enable_array_stats("n")
+    with pytest.raises(ValueError, match="not a tracked argument"):
+        wrapped._enable_array_stats("other")
+    wrapped(b"abc", n=b"")
+    assert wrapped._get_array_stats()[0][1] is None
+    assert wrapped._get_array_stats()[1][1]["sizes"] == {0: 1}
+
+
+def test_disable_enable():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def func(x):
+        return x * 2
+
+    func(1)
+    statswrapper.disable()
+    try:
+        assert not statswrapper.is_enabled()
+        assert func(2) == 4
+
+        # Wrappers created while disabled start out disabled as well
+        @stats_deco(None)  # type: ignore[no-untyped-call]
+        def other(x):
+            return x
+
+        other(1)
+        assert other._get_counts()[0] == 0
+    finally:
+        statswrapper.enable()
+    assert statswrapper.is_enabled()
+    func(3)
+    other(1)
+    assert func._get_counts()[0] == 2
+    assert func._get_param_stats()[0][1] == 2
+    assert other._get_counts()[0] == 1
+
+
+@pytest.mark.skipif(sys.version_info < (3, 12), reason="requires sys.monitoring")
+@pytest.mark.skipif(sys.implementation.name != "cpython", reason="CPython only")
+def test_monitor():
+    def func(x):
+        if x is None:
+            raise ValueError
+        return x * 2
+
+    def unrelated():
+        pass
+
+    stats = monitor(func)
+    alias = func
+    assert alias(2) == 4
+    assert stats(3) == 6  # the wrapper still calls func
+    with pytest.raises(ValueError):
+        func(None)
+    unrelated()
+
+    assert stats._get_counts()[:2] == (3, 1)
+    assert stats._get_timing()["samples"] == 3
+
+    with pytest.raises(TypeError, match="plain Python function"):
+        monitor(len)
+
+    tools = [sys.monitoring.get_tool(i) for i in range(6)]
+    assert tools.count("telemetric") == 1
+    assert tools[sys.monitoring.PROFILER_ID] != "telemetric"
+    # Only the monitored code is instrumented
+    tool = tools.index("telemetric")
+    assert sys.monitoring.get_events(tool) == sys.monitoring.events.PY_UNWIND
+    assert sys.monitoring.get_local_events(tool, func.__code__) != 0
+    assert sys.monitoring.get_local_events(tool, unrelated.__code__) == 0
+
+    # Code whose wrapper was freed is disabled, monitoring it re-enables it
+    def make():  # type: ignore[no-untyped-def]
+        def closure():  # type: ignore[no-untyped-def]
+            pass
+
+        return closure
+
+    monitor(make())
+    gc.collect()
+    make()()
+    closure = make()
+    closure_stats = monitor(closure)
+    closure()
+    assert closure_stats._get_counts()[0] == 1
+    unmonitor(closure)
+
+    unmonitor(func)
+    assert sys.monitoring.get_local_events(tool, func.__code__) == 0
+    func(2)
+    assert stats._get_counts()[0] == 3
+    assert "telemetric" not in [sys.monitoring.get_tool(i) for i in range(6)]
+    with pytest.raises(ValueError, match="not monitored"):
+        unmonitor(func)
+
+
+@pytest.mark.skipif(sys.version_info < (3, 12), reason="requires sys.monitoring")
+@pytest.mark.skipif(sys.implementation.name != "cpython", reason="CPython only")
+def test_monitor_collectable():
+    def func():
+        pass
+
+    stats = monitor(func)
+    func()
+    assert stats._get_counts()[0] == 1
+    ref = weakref.ref(func)
+    del func, stats
+    gc.collect()
+    assert ref() is None
+
+
+def test_export_counters(tmp_path):
+    link = tmp_path / "link"
+    link.symlink_to(tmp_path / "target")
+    with pytest.raises(FileExistsError):
+        export_counters(str(link))
+    assert not (tmp_path / "target").exists()
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def before(x):
+        if x == 1:
+            # The counters are moved while this call is still running.
+            return export_counters(str(tmp_path / "counters"), size=2**20)
+        return x
+
+    path = before(1)
+    assert export_counters() == path  # only exported once
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def after(x):
+        if x is None:
+            raise ValueError
+        return x
+
+    before(2)
+    for i in range(5):
+        after(i)
+    with pytest.raises(ValueError):
+        after(None)
+
+    with ArenaReader(path) as reader:
+        assert reader.pid == os.getpid()
+        counters = {c.name: c for c in reader.read()}
+    name = f"{__name__}.test_export_counters.<locals>."
+    assert counters[name + "before"].calls == 2
+    after_counters = counters[name + "after"]
+    assert after_counters[1:5] == (6, 1, 0, 6)
+    assert sum(after_counters.histogram) == 6
+    assert 0 < after_counters.min_time <= after_counters.max_time
+    assert before._get_counts()[0] == 2
+
+
+def test_top(tmp_path, capsys):
+    from telemetric import top  # pylint: disable=import-outside-toplevel
+
+    path = export_counters(str(tmp_path / "counters"), size=2**20)
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def busy(x):
+        if x < 0:
+            raise ValueError
+        return x
+
+    with ArenaReader(path) as reader:
+        before = reader.read()
+        for i in range(9):
+            busy(i)
+        with pytest.raises(ValueError):
+            busy(-1)
+        lines = top.render(before, reader.read(), 2.0, reader.hist_sub_bits)
+
+    (row,) = [line for line in lines if line.endswith(".busy")]
+    calls_per_second, error_percent = row.split()[:2]
+    assert (calls_per_second, error_percent) == ("5.0", "10.0")
+
+    assert top.main([path, "--interval", "0", "--iterations", "1"]) == 0
+    assert "calls/s" in capsys.readouterr().out
+    assert top.main([str(tmp_path / "missing")]) == 1
+
+
+def test_snapshot_all():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def func(x):
+        if x is None:
+            raise ValueError
+        return x
+
+    for i in range(4):
+        func(i)
+    with pytest.raises(ValueError):
+        func(None)
+    with pytest.raises(TypeError):
+        func(1, 2)  # invalid (too many positional args)
+
+    snapshot = statswrapper.snapshot_all()
+    assert len(snapshot) == len(snapshot.wrappers)
+    row = snapshot.wrappers.index(func)
+    data = memoryview(snapshot)
+    assert data.shape == (len(snapshot.columns), len(snapshot))
+    assert data.format == "q"
+    assert data.readonly
+    values = {name: snapshot.column(name)[row] for name in snapshot.columns}
+    timing = func._get_timing()
+    assert values["calls"] == 6
+    assert values["errors"] == 2
+    assert values["invalid"] == 1
+    assert values["timed"] == timing["samples"] == 6
+    assert values["min_ns"] * 1e-9 == pytest.approx(timing["min"])
+    assert values["est_total_ns"] * 1e-9 == pytest.approx(timing["total"])
+    assert data[0, row] == 6
+
+    with pytest.raises(KeyError):
+        snapshot.column("unknown")
+
+    # Consumers not asking for a format get plain bytes
+    raw = array.array("B")
+    raw.frombytes(snapshot)  # type: ignore[arg-type]
+    assert len(raw) == data.nbytes
+
+    # A snapshot stored on a wrapper is a cycle the GC can collect
+    def plain():
+        pass
+
+    wrapper = statswrapper.stats_wrapper(plain)
+    wrapper.last = statswrapper.snapshot_all()
+    ref = weakref.ref(plain)
+    del plain, wrapper
+    gc.collect()
+    assert ref() is None
+
+
+def test_snapshot_and_reset():
+    @stats_deco(None, mode=("a", "b"))  # type: ignore[no-untyped-call]
+    def func(x, mode="a"):
+        return x, mode
+
+    func._enable_sketch()
+    func(1, mode="a")
+    func(2, mode="b")
+    func(3)
+
+    stats = func._snapshot_and_reset()
+    assert stats["counts"] == (3, 0, 0)
+    assert stats["timing"]["samples"] == 3
+    assert sum(stats["histogram"]["buckets"]) == 3
+    assert stats["param_stats"][1][3] == (1, 1)
+    assert stats["sketch"].count == 3
+
+    # Everything starts from scratch, including min/max
+    assert func._get_counts() == (0, 0, 0)
+    assert func._get_timing()["max"] == 0
+    assert func._get_param_stats()[1][3] == (0, 0)
+    assert func._get_sketch().count == 0
+
+    func(4, mode="b")
+    active = dict(statswrapper.snapshot_and_reset_all())
+    assert active[func]["counts"] == (1, 0, 0)
+    assert active[func]["param_stats"][1][3] == (0, 1)
+    assert func not in dict(statswrapper.snapshot_and_reset_all())
+
+    # The layout can not be changed after calls were reset
+    with pytest.raises(RuntimeError, match="before the first call"):
+        func._enable_type_stats()
+
+
+def test_self_and_outermost_time():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def inner():
+        time.sleep(0.02)
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def outer():
+        inner()
+        time.sleep(0.01)
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def recurse(n):
+        time.sleep(0.005)
+        if n > 0:
+            recurse(n - 1)
+
+    outer()
+    timing = outer._get_timing()
+    inner_total = inner._get_timing()["total"]
+    assert timing["self"] == pytest.approx(timing["total"] - inner_total)
+    assert 0.01 <= timing["self"] < inner_total
+    assert timing["outermost"] == timing["total"]
+    assert inner._get_timing()["self"] == inner_total
+
+    recurse(3)
+    timing = recurse._get_timing()
+    # The nested calls are counted in 'total' again, but not in 'outermost'
+    assert 0.02 <= timing["outermost"] < timing["total"]
+    assert timing["self"] == pytest.approx(timing["outermost"])
+
+
+def test_callers():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def leaf():
+        time.sleep(0.001)
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def public_a():
+        leaf()
+        leaf()
+
+    def _public_b():
+        leaf()
+
+    # Not via stats_deco, which keeps the wrapper alive
+    public_b = statswrapper.stats_wrapper(_public_b)
+
+    public_a()
+    public_b()
+    leaf()
+
+    callers = {caller: rest for caller, *rest in leaf._get_callers()}
+    assert set(callers) == {public_a, public_b}
+    assert callers[public_a][0] == 2
+    assert callers[public_b][0] == 1
+    assert callers[public_a][1] >= 0.002
+    assert public_a._get_callers() == []
+
+    edges = {(e.caller, e.callee): e.calls for e in call_graph()}
+    assert edges[public_a, leaf] == 2
+
+    out = io.StringIO()
+    write_collapsed(out, weight="calls")
+    lines = dict(line.rsplit(" ", 1) for line in out.getvalue().splitlines())
+    assert lines[f"{__name__}.public_a;{__name__}.leaf"] == "2"
+    assert lines[f"{__name__}.leaf"] == "1"  # the call without wrapped caller
+
+    with pytest.raises(ValueError, match="weight"):
+        write_collapsed(out, weight="memory")
+
+    # The export looks up the callers of all wrappers at once
+    active = dict(statswrapper.snapshot_and_reset_all())
+    callers = {caller: rest for caller, *rest in active[leaf]["callers"]}
+    assert callers[public_a][0] == 2
+    assert callers[public_b][0] == 1
+    assert statswrapper.snapshot_and_reset_all() == []
+
+    # Also of callers that did not return since the last export
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def running():
+        statswrapper.snapshot_and_reset_all()
+        leaf()
+        return dict(statswrapper.snapshot_and_reset_all())
+
+    active = running()
+    assert running not in active
+    assert [caller for caller, *_ in active[leaf]["callers"]] == [running]
+
+    public_a()
+    public_b()
+    del public_b, edges, callers, active
+    callers = {caller: rest for caller, *rest in leaf._get_callers()}
+    assert callers[None][0] == 1  # the caller is gone
+
+
+def test_generators_and_coroutines():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def gen(n):
+        for i in range(n):
+            time.sleep(0.005)
+            yield i
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    async def coro(x):
+        time.sleep(0.005)
+        await asyncio.sleep(0.02)
+        if x is None:
+            raise ValueError
+        return x
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    async def agen(n):
+        for i in range(n):
+            await asyncio.sleep(0.01)
+            yield i
+
+    assert list(gen(3)) == [0, 1, 2]
+    timing = gen._get_timing()
+    assert timing["samples"] == 1
+    assert timing["total"] >= 0.015
+
+    async def main():
+        with pytest.raises(ValueError):
+            await coro(None)
+        values = [i async for i in agen(2)]
+        return await asyncio.create_task(coro(1)), values
+
+    assert asyncio.run(main()) == (1, [0, 1])
+    assert coro._get_counts() == (2, 1, 0)
+    timing = coro._get_timing()
+    assert timing["samples"] == 2
+    # Only the time running counts, 'wall' includes the time suspended
+    assert 0.01 <= timing["total"] < 0.02 < 0.04 <= timing["wall"]
+    timing = agen._get_timing()
+    assert timing["samples"] == 1
+    assert timing["total"] < 0.02 <= timing["wall"]
+
+
+def test_cpu_time():
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def work(wait):
+        if wait:
+            time.sleep(0.02)
+        else:
+            end = time.perf_counter() + 0.02
+            while time.perf_counter() < end:
+                pass
+
+    assert "cpu_total" not in work._get_timing()
+    work._enable_cpu_time()
+    work(True)
+    timing = work._get_timing()
+    assert timing["cpu_total"] < 0.01 < timing["total"]
+    work(False)
+    timing = work._get_timing()
+    assert timing["cpu_total"] > 0.015
+    assert sum(timing["cpu_histogram"]["buckets"]) == 2
+    assert timing["cpu_average"] == pytest.approx(timing["cpu_total"] / 2)
+
+    func = stats_deco(None)(lambda x: x)  # type: ignore[no-untyped-call]
+    func(1)
+    with pytest.raises(RuntimeError, match="before the first call"):
+        func._enable_cpu_time()
+
+
+Py_TPFLAGS_METHOD_DESCRIPTOR = 1 << 17  # see CPython's object.h
+
+
+def test_method_binding():
+    class Obj:
+        @stats_deco(None, x=None)  # type: ignore[no-untyped-call]
+        def method(self, x):
+            return self, x
+
+    # Method calls skip creating a bound method (like for functions)
+    assert type(Obj.__dict__["method"]).__flags__ & Py_TPFLAGS_METHOD_DESCRIPTOR
+    obj = Obj()
+    assert obj.method(1) == (obj, 1)
+    assert obj.method(x=2) == (obj, 2)
+    bound = obj.method
+    assert bound(3) == (obj, 3)
+    assert Obj.method(obj, 4) == (obj, 4)
+    assert Obj.method._get_counts() == (4, 0, 0)
+
+
+def test_call_variants():
+    # The call implementation depends on the configuration, check that
+    # switching it keeps all counts.
+    @stats_deco(None, None, None, None, None, c=None)  # type: ignore[no-untyped-call]
+    def func(*args, c=None):
+        return len(args)
+
+    func._enable_type_stats()
+    func._set_sampling(0)
+    assert func(1, 2, 3, 4, 5) == 5
+    func._set_sampling(1)
+    func(1, c=2)
+    assert func._get_counts() == (2, 0, 0)
+    assert func._get_timing()["samples"] == 1
+    assert [s[1] for s in func._get_param_stats()] == [2, 1, 1, 1, 1, 1]
+    assert func._get_type_stats()[0][1] == {int: 2}
+
+    @stats_deco(None, None, None, None, None)  # type: ignore[no-untyped-call]
+    def simple(*args):
+        return len(args)
+
+    simple._set_sampling(0)
+    for n in range(6):
+        assert simple(*range(n)) == n
+    assert simple(*range(7)) == 7  # too many arguments
+    assert simple._get_counts() == (7, 0, 1)
+    assert [s[1] for s in simple._get_param_stats()] == [6, 5, 4, 3, 2]
+    assert simple._get_timing()["samples"] == 0
+
+    # Untimed calls are not on the call stack, callees see their caller.
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def inner():
+        pass
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def middle():
+        inner()
+
+    @stats_deco(None)  # type: ignore[no-untyped-call]
+    def outer():
+        middle()
+
+    middle._set_sampling(0)
+    outer()
+    assert [caller for caller, *_ in inner._get_callers()] == [outer]
+    assert middle._get_callers() == []
+    assert middle._get_counts()[0] == 1
+
+
+@pytest.mark.skipif(sys.version_info < (3, 10), reason="PyType_GetSlot of static types")
+@pytest.mark.skipif(sys.implementation.name != "cpython", reason="CPython only")
+def test_cleared_wrapper():
+    # Call tp_clear directly, as the GC does to break a cycle
+    import ctypes  # pylint: disable=import-outside-toplevel
+
+    get_slot = ctypes.pythonapi.PyType_GetSlot
+    get_slot.restype = ctypes.c_void_p
+    get_slot.argtypes = [ctypes.py_object, ctypes.c_int]
+    py_tp_clear = 51
+    clear = ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.py_object)(
+        get_slot(statswrapper._StatsWrapper, py_tp_clear)
+    )
+
+    @stats_deco(None, mode=("a", "b"))  # type: ignore[no-untyped-call]
+    def func(x, mode="a"):
+        return x
+
+    func._enable_type_stats()
+    func(1, mode="a")
+    clear(func)
+    with pytest.raises(ReferenceError):
+        func(1)
+    assert getattr(func, "__name__", None) is None
+    assert func._get_counts() == (1, 0, 0)
+    assert func._get_param_stats()[0][1] == 1
+    assert func in dict(statswrapper.snapshot_and_reset_all())
+
+
+def test_compact_wrappers():
+    def func(x, mode="fast"):
+        """Docstring."""
+        return x
+
+    func.tag = "tagged"  # type: ignore[attr-defined]
+    new = stats_deco(None, mode=("fast", 1))(func)  # type: ignore[no-untyped-call]
+    assert new.__name__ == "func"
+    assert new.__qualname__ == func.__qualname__
+    assert new.__module__ == __name__
+    assert new.__doc__ == "Docstring."
+    assert new.__wrapped__ is func
+    assert new.__code__ is func.__code__
+    assert new.tag == "tagged"
+    assert new.__dict__ == {"tag": "tagged"}
+    new.__name__ = "renamed"
+    assert new.__name__ == "renamed"
+    assert func.__name__ == "func"
+    del new.__name__
+    assert new.__name__ == "func"
+
+    # Only a plain function's wrapper has no attributes of its own.
+    plain = stats_deco(None)(lambda x: x)  # type: ignore[no-untyped-call]
+    assert plain.__dict__ == {}
+
+    # Wrappers with the same signature share the argument specs, but equal
+    # tracked values of different types are kept apart.
+    other = stats_deco(None, mode=("fast", True))(func)  # type: ignore[no-untyped-call]
+    same = stats_deco(None, mode=("fast", 1))(func)  # type: ignore[no-untyped-call]
+    new(1, mode=1)
+    other(1, mode=True)
+    same(1, mode="fast")
+    assert new._get_param_stats()[1][2:] == (("fast", 1), (0, 1))
+    assert other._get_param_stats()[1][2:] == (("fast", True), (0, 1))
+    assert same._get_param_stats()[1][2:] == (("fast", 1), (1, 0))
+    # The last wrapper releasing a spec drops it
+    for _ in range(2):
+        raw = statswrapper.stats_wrapper(func, None, mode=("slow",))
+        raw(1, mode="slow")
+        assert raw._get_param_stats()[1][3] == (1,)
+        del raw
+    # Tracked values referencing the wrapper do not keep it alive
+    class Mode:
+        pass
+
+    mode = Mode()
+    mode.wrapper = statswrapper.stats_wrapper(func, None, mode=(mode,))  # type: ignore[attr-defined]
+    mode.wrapper(1, mode=mode)  # type: ignore[attr-defined]
+    ref = weakref.ref(mode)
+    del mode
+    gc.collect()
+    assert ref() is None
+
+
+def test_collected_stats():
+    def make():  # type: ignore[no-untyped-def]
+        @stats_deco(None)  # type: ignore[no-untyped-call]
+        def closure(x):  # type: ignore[no-untyped-def]
+            return closure  # the cell references the wrapper, a cycle
+        return closure
+
+    module = make().__module__
+    gc.collect()
+    empty = {"wrappers": 0, "calls": 0, "errors": 0, "timed": 0}
+    before = statswrapper.collected_stats().get(module, empty)
+
+    func = make()
+    func.attribute = func  # a cycle through the dict
+    func(1)
+    func(2)
+    with pytest.raises(TypeError):
+        func()
+    make()(3)
+    del func
+    gc.collect()
+
+    after = statswrapper.collected_stats()[module]
+    assert after["wrappers"] - before["wrappers"] == 2
+    assert after["calls"] - before["calls"] == 4
+    assert after["errors"] - before["errors"] == 1
+    assert after["timed"] - before["timed"] == 4
+    assert 0 < after["min_ns"] <= after["max_ns"]
+    assert set(after) == {"wrappers", *statswrapper.snapshot_all().columns}